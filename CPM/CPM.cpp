@@ -2,12 +2,184 @@
 #include "CPM.h"
 #include "include/ImageFeature.h"
 
-#include "opencv2/xfeatures2d.hpp" // for "DAISY" descriptor
+#include <climits>
+#include <cfloat>
+#include <algorithm>
 
 // [4/6/2017 Yinlin.Hu]
 
 #define UNKNOWN_FLOW 1e10
 
+// bytes the descriptors are padded to, so that MatchCost has no tail to handle
+#define FEATURE_ALIGN 32
+
+// size of the DAISY descriptor computed by imDaisy, without padding
+#define DAISY_DIM ((3 * 4 + 1) * 8)
+
+// bytes per pixel used by the DAISY of a crop while it runs: color crop, gray copy,
+// gradient layers, smoothing buffer and one smoothed copy of the layers per ring (8 floats each)
+#define DAISY_WORK_BYTES (12 + 4 + (2 + 3) * 8 * 4)
+
+#ifdef WITH_SSE
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPM_WITH_AVX
+#include <immintrin.h>
+#endif
+
+// sum of absolute differences of two descriptors of ch bytes
+static int SadSSE2(const unsigned char* p1, const unsigned char* p2, int ch)
+{
+	__m128i sum = _mm_setzero_si128();
+	int k = 0;
+	for (; k + 16 <= ch; k += 16){
+		__m128i r1 = _mm_loadu_si128((const __m128i*)(p1 + k));
+		__m128i r2 = _mm_loadu_si128((const __m128i*)(p2 + k));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(r1, r2));
+	}
+	int totalDiff = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+	// only for descriptors which are not padded
+	for (; k < ch; k++){
+		totalDiff += abs(p1[k] - p2[k]);
+	}
+	return totalDiff;
+}
+
+// same as above, but stops as soon as the partial sum reaches bound
+static int SadSSE2Bounded(const unsigned char* p1, const unsigned char* p2, int ch, int bound, bool* early)
+{
+	__m128i sum = _mm_setzero_si128();
+	int totalDiff = 0;
+	int k = 0;
+	for (; k + 16 <= ch; k += 16){
+		__m128i r1 = _mm_loadu_si128((const __m128i*)(p1 + k));
+		__m128i r2 = _mm_loadu_si128((const __m128i*)(p2 + k));
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(r1, r2));
+		totalDiff = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+		if (totalDiff >= bound){
+			*early = (k + 16 < ch);
+			return totalDiff;
+		}
+	}
+	for (; k < ch; k++){
+		totalDiff += abs(p1[k] - p2[k]);
+	}
+	*early = false;
+	return totalDiff;
+}
+
+#ifdef CPM_WITH_AVX
+// ch must be a multiple of 32
+__attribute__((target("avx2")))
+static int SadAVX2(const unsigned char* p1, const unsigned char* p2, int ch)
+{
+	__m256i sum = _mm256_setzero_si256();
+	for (int k = 0; k < ch; k += 32){
+		__m256i r1 = _mm256_loadu_si256((const __m256i*)(p1 + k));
+		__m256i r2 = _mm256_loadu_si256((const __m256i*)(p2 + k));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(r1, r2));
+	}
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	return _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+}
+
+__attribute__((target("avx2")))
+static int SadAVX2Bounded(const unsigned char* p1, const unsigned char* p2, int ch, int bound, bool* early)
+{
+	__m256i sum = _mm256_setzero_si256();
+	int totalDiff = 0;
+	for (int k = 0; k < ch; k += 32){
+		__m256i r1 = _mm256_loadu_si256((const __m256i*)(p1 + k));
+		__m256i r2 = _mm256_loadu_si256((const __m256i*)(p2 + k));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(r1, r2));
+		__m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+		totalDiff = _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+		if (totalDiff >= bound){
+			*early = (k + 32 < ch);
+			return totalDiff;
+		}
+	}
+	*early = false;
+	return totalDiff;
+}
+
+// ch must be a multiple of 32, a last half vector is done with AVX2
+__attribute__((target("avx512f,avx512bw")))
+static int SadAVX512(const unsigned char* p1, const unsigned char* p2, int ch)
+{
+	__m512i sum = _mm512_setzero_si512();
+	int k = 0;
+	for (; k + 64 <= ch; k += 64){
+		__m512i r1 = _mm512_loadu_si512((const void*)(p1 + k));
+		__m512i r2 = _mm512_loadu_si512((const void*)(p2 + k));
+		sum = _mm512_add_epi64(sum, _mm512_sad_epu8(r1, r2));
+	}
+	__m256i s256 = _mm256_add_epi64(_mm512_castsi512_si256(sum), _mm512_extracti64x4_epi64(sum, 1));
+	if (k < ch){
+		__m256i r1 = _mm256_loadu_si256((const __m256i*)(p1 + k));
+		__m256i r2 = _mm256_loadu_si256((const __m256i*)(p2 + k));
+		s256 = _mm256_add_epi64(s256, _mm256_sad_epu8(r1, r2));
+	}
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(s256), _mm256_extracti128_si256(s256, 1));
+	return _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int SadAVX512Bounded(const unsigned char* p1, const unsigned char* p2, int ch, int bound, bool* early)
+{
+	__m512i sum = _mm512_setzero_si512();
+	int totalDiff = 0;
+	int k = 0;
+	for (; k + 64 <= ch; k += 64){
+		__m512i r1 = _mm512_loadu_si512((const void*)(p1 + k));
+		__m512i r2 = _mm512_loadu_si512((const void*)(p2 + k));
+		sum = _mm512_add_epi64(sum, _mm512_sad_epu8(r1, r2));
+		__m256i s256 = _mm256_add_epi64(_mm512_castsi512_si256(sum), _mm512_extracti64x4_epi64(sum, 1));
+		__m128i s = _mm_add_epi64(_mm256_castsi256_si128(s256), _mm256_extracti128_si256(s256, 1));
+		totalDiff = _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+		if (totalDiff >= bound){
+			*early = (k + 64 < ch);
+			return totalDiff;
+		}
+	}
+	if (k < ch){
+		__m256i r1 = _mm256_loadu_si256((const __m256i*)(p1 + k));
+		__m256i r2 = _mm256_loadu_si256((const __m256i*)(p2 + k));
+		__m256i s256 = _mm256_sad_epu8(r1, r2);
+		__m128i s = _mm_add_epi64(_mm256_castsi256_si128(s256), _mm256_extracti128_si256(s256, 1));
+		totalDiff += _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_srli_si128(s, 8));
+	}
+	*early = false;
+	return totalDiff;
+}
+#endif
+
+typedef int(*SadFunc)(const unsigned char*, const unsigned char*, int);
+typedef int(*SadBoundedFunc)(const unsigned char*, const unsigned char*, int, int, bool*);
+
+// widest instruction set supported by the CPU we are running on: 0 SSE2, 1 AVX2, 2 AVX-512BW
+static int SelectISA()
+{
+#ifdef CPM_WITH_AVX
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw"))
+		return 2;
+	if (__builtin_cpu_supports("avx2"))
+		return 1;
+#endif
+	return 0;
+}
+
+static const int g_isa = SelectISA();
+#ifdef CPM_WITH_AVX
+static const SadFunc g_sadAligned = g_isa == 2 ? SadAVX512 : (g_isa == 1 ? SadAVX2 : SadSSE2);
+static const SadBoundedFunc g_sadBoundedAligned = g_isa == 2 ? SadAVX512Bounded : (g_isa == 1 ? SadAVX2Bounded : SadSSE2Bounded);
+#else
+static const SadFunc g_sadAligned = SadSSE2;
+static const SadBoundedFunc g_sadBoundedAligned = SadSSE2Bounded;
+#endif
+#endif
+
 CPM::CPM()
 {
 	// default parameters
@@ -29,23 +201,173 @@ CPM::CPM()
     _borderWidth = 5;
 
     _costCheckThreshold = 1000; //CPM modify in tip2017 #tipModification
-    
-	_im1f = NULL;
-	_im2f = NULL;
+
+	_parallelPropagation = 0;
+	_warmStartRadius = 16;
+	_warmStartWarp = 0;
+	_tileMemory = 0;
+	_roiX = _roiY = _roiW = _roiH = 0;
+	_binomialPyramid = 0;
+
+	_descDim = 0;
+	_pcaScale = 1;
+	_pcaCostScale = 1;
+}
+
+CPM::~CPM()
+{
+}
+
+CPMFeatures::CPMFeatures()
+{
+	_nLevels = 0;
+	_ftImgs = NULL;
+	_costScale = 1;
+	_ox = _oy = 0;
+}
+
+CPMFeatures::~CPMFeatures()
+{
+	ReleaseLevels();
+}
+
+void CPMFeatures::AllocateLevels(int nLevels)
+{
+	if (nLevels == _nLevels)
+		return;
+
+	ReleaseLevels();
+	_nLevels = nLevels;
+	_ftImgs = new UCImage[nLevels];
+}
+
+void CPMFeatures::ReleaseLevels()
+{
+	if (_ftImgs)
+		delete[] _ftImgs;
+	_ftImgs = NULL;
+	_nLevels = 0;
+}
+
+CPMLevelStats::CPMLevelStats()
+{
+	width = height = 0;
+	pyramidTime = featureTime = propagationTime = checkTime = radiusTime = 0;
+	for (int d = 0; d < 2; d++){
+		iterations[d] = 0;
+		matchCostCalls[d] = 0;
+		earlyRejects[d] = 0;
+		crossCheckRejects[d] = 0;
+		costCheckRejects[d] = 0;
+	}
+	reinitializations = 0;
+}
+
+CPMStats::CPMStats()
+{
+	numSeeds = 0;
+	matchTime = 0;
+}
+
+void CPMStats::Reset(int nLevels)
+{
+	numSeeds = 0;
+	matchTime = 0;
+	levels.assign(nLevels, CPMLevelStats());
+}
+
+static void WriteJSONArray(FILE* fp, const float* values, int n)
+{
+	fprintf(fp, "[");
+	for (int i = 0; i < n; i++){
+		fprintf(fp, i ? ", %.4f" : "%.4f", values[i]);
+	}
+	fprintf(fp, "]");
+}
+
+void CPMStats::WriteJSON(FILE* fp) const
+{
+	fprintf(fp, "{\"seeds\": %d, \"match_time\": %.6f, \"levels\": [\n", numSeeds, matchTime);
+	for (size_t l = 0; l < levels.size(); l++){
+		const CPMLevelStats& st = levels[l];
+		fprintf(fp, "  {\"level\": %d, \"width\": %d, \"height\": %d,\n", (int)l, st.width, st.height);
+		fprintf(fp, "   \"pyramid_time\": %.6f, \"feature_time\": %.6f, \"propagation_time\": %.6f, \"check_time\": %.6f, \"radius_time\": %.6f,\n",
+			st.pyramidTime, st.featureTime, st.propagationTime, st.checkTime, st.radiusTime);
+		fprintf(fp, "   \"iterations\": [%d, %d], \"update_ratios\": [", st.iterations[0], st.iterations[1]);
+		for (int d = 0; d < 2; d++){
+			if (d) fprintf(fp, ", ");
+			WriteJSONArray(fp, st.updateRatios[d].empty() ? NULL : &st.updateRatios[d][0], st.updateRatios[d].size());
+		}
+		fprintf(fp, "],\n");
+		fprintf(fp, "   \"match_cost_calls\": [%lld, %lld], \"early_rejects\": [%lld, %lld],\n",
+			st.matchCostCalls[0], st.matchCostCalls[1], st.earlyRejects[0], st.earlyRejects[1]);
+		fprintf(fp, "   \"cross_check_rejects\": [%d, %d], \"cost_check_rejects\": [%d, %d], \"reinitializations\": %d}%s\n",
+			st.crossCheckRejects[0], st.crossCheckRejects[1], st.costCheckRejects[0], st.costCheckRejects[1],
+			st.reinitializations, (l + 1 < levels.size()) ? "," : "");
+	}
+	fprintf(fp, "]}");
+}
+
+bool CPMStats::SaveJSON(const char* filename, const CPMStats* stats, int count)
+{
+	FILE* fp = fopen(filename, "w");
+	if (!fp){
+		printf("cannot write CPM stats to %s\n", filename);
+		return false;
+	}
+	fprintf(fp, "[\n");
+	for (int i = 0; i < count; i++){
+		stats[i].WriteJSON(fp);
+		fprintf(fp, (i + 1 < count) ? ",\n" : "\n");
+	}
+	fprintf(fp, "]\n");
+	fclose(fp);
+	return true;
+}
+
+CPMWorkspace::CPMWorkspace()
+{
+	_nLevels = 0;
+	_costScale = 1;
+	_costEvalCount = 0;
+	_earlyRejectCount = 0;
+	_streamEvalCount[0] = _streamEvalCount[1] = 0;
+	_streamRejectCount[0] = _streamRejectCount[1] = 0;
 	_pydSeedsFlow = NULL;
 	_pydSeedsFlow2 = NULL;
+	_pydSeeds = NULL;
+	_warmStart = false;
 }
 
-CPM::~CPM()
+CPMWorkspace::~CPMWorkspace()
+{
+	ReleaseLevels();
+}
+
+void CPMWorkspace::AllocateLevels(int nLevels)
+{
+	if (nLevels == _nLevels)
+		return;
+
+	ReleaseLevels();
+	_nLevels = nLevels;
+	_pydSeedsFlow = new FImage[nLevels];
+	_pydSeedsFlow2 = new FImage[nLevels];
+	_pydSeeds = new IntImage[nLevels];
+}
+
+void CPMWorkspace::ReleaseLevels()
 {
-	if (_im1f)
-		delete[] _im1f;
-	if (_im2f)
-		delete[] _im2f;
 	if (_pydSeedsFlow)
 		delete[] _pydSeedsFlow;
 	if (_pydSeedsFlow2)
 		delete[] _pydSeedsFlow2;
+	if (_pydSeeds)
+		delete[] _pydSeeds;
+	_pydSeedsFlow = NULL;
+	_pydSeedsFlow2 = NULL;
+	_pydSeeds = NULL;
+	_nLevels = 0;
 }
 
 void CPM::SetStereoFlag(int needStereo)
@@ -73,33 +395,411 @@ void CPM::SetCostCheckThreshold(float costCheckThreshold)
 	_costCheckThreshold = _costCheckThreshold;
 }
 
-int CPM::Matching(FImage& img1, FImage& img2, FImage& outMatches)
+void CPM::SetParallelPropagation(int parallel)
+{
+	_parallelPropagation = parallel;
+}
+
+void CPM::SetWarmStartRadius(int radius)
+{
+	_warmStartRadius = radius;
+}
+
+void CPM::SetWarmStartWarp(int warp)
+{
+	_warmStartWarp = warp;
+}
+
+void CPM::SetTileMemory(int megabytes)
+{
+	_tileMemory = megabytes;
+}
+
+void CPM::SetROI(int x, int y, int w, int h)
+{
+	_roiX = x;
+	_roiY = y;
+	_roiW = w;
+	_roiH = h;
+}
+
+void CPM::SetBinomialPyramid(int binomial)
+{
+	_binomialPyramid = binomial;
+}
+
+void CPM::SetDescriptorDim(int dim)
+{
+	_descDim = dim;
+}
+
+void CPM::TrainPCA(FImage& img)
+{
+	if (_descDim <= 0)
+		return;
+
+	FImagePyramid pyd;
+	BuildPyramid(img, pyd);
+
+	// DAISY of all the levels, subsampled to keep the training set small
+	const int maxSamples = 50000;
+	int totalPixels = 0;
+	for (int i = 0; i < pyd.nlevels(); i++)
+		totalPixels += pyd[i].npixels();
+	int stride = __max(1, (int)ceil(sqrt((float)totalPixels / maxSamples)));
+
+	std::vector<UCImage> daisy(pyd.nlevels());
+	int nSamples = 0;
+	for (int i = 0; i < pyd.nlevels(); i++){
+		imDaisy(pyd[i], daisy[i]);
+		nSamples += ((pyd[i].width() + stride - 1) / stride) * ((pyd[i].height() + stride - 1) / stride);
+	}
+	cv::Mat samples(nSamples, DAISY_DIM, CV_32F);
+	int row = 0;
+	for (int i = 0; i < pyd.nlevels(); i++){
+		for (int y = 0; y < daisy[i].height(); y += stride){
+			for (int x = 0; x < daisy[i].width(); x += stride){
+				unsigned char* p = daisy[i].pixPtr(y, x);
+				float* dst = samples.ptr<float>(row++);
+				for (int k = 0; k < DAISY_DIM; k++)
+					dst[k] = p[k];
+			}
+		}
+	}
+
+	int dim = __min(_descDim, DAISY_DIM);
+	cv::PCA pca(samples, cv::Mat(), cv::PCA::DATA_AS_ROW, dim);
+	_pcaMean = pca.mean.clone();
+	_pcaBasis = pca.eigenvectors.clone();
+	_pcaScale = 127.f / (3.f * sqrt(__max(pca.eigenvalues.at<float>(0), 1e-6f)));
+
+	// retained variance
+	cv::Mat centered = samples - cv::repeat(_pcaMean, samples.rows, 1);
+	double totalVar = cv::sum(centered.mul(centered))[0] / samples.rows;
+	double keptVar = cv::sum(pca.eigenvalues)[0];
+	printf("CPM PCA: %d dims keep %.1f%% of the DAISY variance\n", dim, 100. * keptVar / __max(totalVar, 1e-12));
+
+	UpdatePCACostScale(samples);
+}
+
+bool CPM::LoadPCA(const char* filename)
+{
+	cv::FileStorage fs(filename, cv::FileStorage::READ);
+	if (!fs.isOpened())
+		return false;
+	cv::Mat mean, basis;
+	float scale = 0, costScale = 0;
+	fs["mean"] >> mean;
+	fs["basis"] >> basis;
+	fs["scale"] >> scale;
+	fs["cost_scale"] >> costScale;
+	if (basis.empty() || basis.cols != DAISY_DIM || mean.cols != DAISY_DIM || scale <= 0 || costScale <= 0){
+		printf("CPM PCA: invalid basis in %s\n", filename);
+		return false;
+	}
+	int dim = __min(_descDim, DAISY_DIM);
+	if (_descDim > 0 && basis.rows != dim){
+		printf("CPM PCA: %s holds a basis of %d components, %d requested, not used\n", filename, basis.rows, dim);
+		return false;
+	}
+	_pcaMean = mean;
+	_pcaBasis = basis;
+	_pcaScale = scale;
+	_pcaCostScale = costScale;
+	_descDim = basis.rows;
+	return true;
+}
+
+bool CPM::SavePCA(const char* filename) const
+{
+	if (!HasPCA())
+		return false;
+	cv::FileStorage fs(filename, cv::FileStorage::WRITE);
+	if (!fs.isOpened())
+		return false;
+	fs << "mean" << _pcaMean;
+	fs << "basis" << _pcaBasis;
+	fs << "scale" << _pcaScale;
+	fs << "cost_scale" << _pcaCostScale;
+	return true;
+}
+
+// ratio between the full and the compact costs of the same descriptor pairs,
+// used to bring the cost check threshold to the scale of the compact descriptors
+void CPM::UpdatePCACostScale(const cv::Mat& samples)
+{
+	// one sample per row, consecutive samples are compared
+	int n = samples.rows;
+	UCImage fullImg(1, n, DAISY_DIM), compact;
+	for (int i = 0; i < n; i++){
+		const float* src = samples.ptr<float>(i);
+		for (int k = 0; k < DAISY_DIM; k++)
+			fullImg.pData[i*DAISY_DIM + k] = src[k];
+	}
+	ProjectFeatures(fullImg, compact);
+
+	double fullCost = 0, compactCost = 0;
+	int cc = compact.nchannels();
+	for (int i = 0; i + 1 < n; i++){
+		for (int k = 0; k < DAISY_DIM; k++)
+			fullCost += abs(fullImg.pData[i*DAISY_DIM + k] - fullImg.pData[(i + 1)*DAISY_DIM + k]);
+		for (int k = 0; k < cc; k++)
+			compactCost += abs(compact.pData[i*cc + k] - compact.pData[(i + 1)*cc + k]);
+	}
+	_pcaCostScale = compactCost > 0 ? fullCost / compactCost : 1;
+}
+
+void CPM::ProjectFeatures(UCImage& ftImg, UCImage& outCompact) const
+{
+	int w = ftImg.width();
+	int h = ftImg.height();
+	int ch = ftImg.nchannels();
+	int dim = _pcaBasis.rows;
+	int outCh = (dim + FEATURE_ALIGN - 1) / FEATURE_ALIGN * FEATURE_ALIGN;
+
+	if (!outCompact.matchDimension(w, h, outCh))
+		outCompact.allocate(w, h, outCh);
+
+	// (x - mean) * B' = x * B' - mean * B'
+	cv::Mat offset = _pcaMean * _pcaBasis.t();
+
+#pragma omp parallel for
+	for (int y = 0; y < h; y++){
+		cv::Mat x(w, DAISY_DIM, CV_32F), proj;
+		for (int i = 0; i < w; i++){
+			unsigned char* p = ftImg.pData + (y*w + i)*ch;
+			float* dst = x.ptr<float>(i);
+			for (int k = 0; k < DAISY_DIM; k++)
+				dst[k] = p[k];
+		}
+		cv::gemm(x, _pcaBasis, 1, cv::noArray(), 0, proj, cv::GEMM_2_T);
+		const float* off = offset.ptr<float>(0);
+		for (int i = 0; i < w; i++){
+			const float* src = proj.ptr<float>(i);
+			unsigned char* dst = outCompact.pData + (y*w + i)*outCh;
+			for (int k = 0; k < dim; k++){
+				float v = (src[k] - off[k]) * _pcaScale + 128;
+				dst[k] = __min(__max(v + 0.5f, 0), 255);
+			}
+			for (int k = dim; k < outCh; k++)
+				dst[k] = 0;
+		}
+	}
+}
+
+int CPM::Matching(FImage& img1, FImage& img2, FImage& outMatches) const
+{
+	CPMWorkspace ws;
+	return Matching(img1, img2, outMatches, ws);
+}
+
+int CPM::Matching(FImage& img1, FImage& img2, FImage& outMatches, CPMWorkspace& ws) const
+{
+	ExtractFeatures(img1, ws._feats1);
+	ExtractFeatures(img2, ws._feats2);
+	return Matching(ws._feats1, ws._feats2, outMatches, ws);
+}
+
+int CPM::Matching(CPMFeatures& feats1, CPMFeatures& feats2, FImage& outMatches, CPMWorkspace& ws, FImage* prevMatches) const
+{
+	MatchSeeds(feats1, feats2, ws, prevMatches);
+	return SeedsFlowToMatches(ws._grid, ws._pydSeeds[0], ws._pydSeedsFlow[0], outMatches, ws);
+}
+
+int CPM::MatchingBidirectional(FImage& img1, FImage& img2, FImage& outFwdMatches, FImage& outBwdMatches) const
+{
+	CPMWorkspace ws;
+	return MatchingBidirectional(img1, img2, outFwdMatches, outBwdMatches, ws);
+}
+
+int CPM::MatchingBidirectional(FImage& img1, FImage& img2, FImage& outFwdMatches, FImage& outBwdMatches, CPMWorkspace& ws) const
+{
+	ExtractFeatures(img1, ws._feats1);
+	ExtractFeatures(img2, ws._feats2);
+	return MatchingBidirectional(ws._feats1, ws._feats2, outFwdMatches, outBwdMatches, ws);
+}
+
+int CPM::MatchingBidirectional(CPMFeatures& feats1, CPMFeatures& feats2, FImage& outFwdMatches, FImage& outBwdMatches, CPMWorkspace& ws, FImage* prevMatches) const
+{
+	MatchSeeds(feats1, feats2, ws, prevMatches);
+	SeedsFlowToMatches(ws._grid, ws._pydSeeds[0], ws._pydSeedsFlow2[0], outBwdMatches, ws);
+	return SeedsFlowToMatches(ws._grid, ws._pydSeeds[0], ws._pydSeedsFlow[0], outFwdMatches, ws);
+}
+
+int CPM::MatchingToFlow(FImage& img1, FImage& img2, cv::Mat2f& outFlow) const
+{
+	CPMWorkspace ws;
+	ExtractFeatures(img1, ws._feats1);
+	ExtractFeatures(img2, ws._feats2);
+	MatchSeeds(ws._feats1, ws._feats2, ws, NULL);
+	return SeedsFlowToDense(ws._grid, ws._pydSeeds[0], ws._pydSeedsFlow[0], outFlow);
+}
+
+int CPM::MatchingToFlow(CPMFeatures& feats1, CPMFeatures& feats2, cv::Mat2f& outFwdFlow, cv::Mat2f& outBwdFlow, CPMWorkspace& ws) const
+{
+	MatchSeeds(feats1, feats2, ws, NULL);
+	SeedsFlowToDense(ws._grid, ws._pydSeeds[0], ws._pydSeedsFlow2[0], outBwdFlow);
+	return SeedsFlowToDense(ws._grid, ws._pydSeeds[0], ws._pydSeedsFlow[0], outFwdFlow);
+}
+
+int CPM::MatchingToDisp(FImage& img1, FImage& img2, cv::Mat1f& outDisp) const
+{
+	CPMWorkspace ws;
+	ExtractFeatures(img1, ws._feats1);
+	ExtractFeatures(img2, ws._feats2);
+	MatchSeeds(ws._feats1, ws._feats2, ws, NULL);
+	return SeedsFlowToDense(ws._grid, ws._pydSeeds[0], ws._pydSeedsFlow[0], outDisp);
+}
+
+int CPM::MatchingToDisp(CPMFeatures& feats1, CPMFeatures& feats2, cv::Mat1f& outFwdDisp, cv::Mat1f& outBwdDisp, CPMWorkspace& ws) const
+{
+	MatchSeeds(feats1, feats2, ws, NULL);
+	SeedsFlowToDense(ws._grid, ws._pydSeeds[0], ws._pydSeedsFlow2[0], outBwdDisp);
+	return SeedsFlowToDense(ws._grid, ws._pydSeeds[0], ws._pydSeedsFlow[0], outFwdDisp);
+}
+
+int CPM::MatchingMultiView(CPMFeatures* feats, int nViews, int center, FImage* outMatches, CPMWorkspace& ws, CPMStats* outStats, CPMWorkspace* wsLeft) const
+{
+	return MatchMultiView(feats, nViews, center, outMatches, NULL, ws, outStats, wsLeft);
+}
+
+int CPM::MatchingMultiViewToDisp(CPMFeatures* feats, int nViews, int center, cv::Mat1f* outDisp, CPMWorkspace& ws, CPMStats* outStats, CPMWorkspace* wsLeft) const
+{
+	return MatchMultiView(feats, nViews, center, NULL, outDisp, ws, outStats, wsLeft);
+}
+
+int CPM::MatchMultiView(CPMFeatures* feats, int nViews, int center, FImage* outMatches, cv::Mat1f* outDisp, CPMWorkspace& ws, CPMStats* outStats, CPMWorkspace* wsLeft) const
+{
+	assert(center >= 0 && center < nViews);
+
+	int totalCnt = 0;
+	// the views on the right of the center, then the ones on the left: each chain only
+	// reads its own previous pair, so with wsLeft the two run at the same time
+	#pragma omp parallel for num_threads(2) schedule(static, 1) reduction(+:totalCnt) if(wsLeft != NULL)
+	for (int s = 0; s < 2; s++){
+		int side = 1 - 2 * s;
+		CPMWorkspace& sws = (side == -1 && wsLeft) ? *wsLeft : ws;
+		FImage prevMatches;
+		for (int k = 1; center + side * k >= 0 && center + side * k < nViews; k++){
+			int v = center + side * k;
+			FImage* warmInit = (k > 1) ? &prevMatches : NULL;
+			MatchSeeds(feats[center], feats[v], sws, warmInit, (k > 1) ? float(k) / (k - 1) : 1.f, false);
+			if (outStats)
+				outStats[v] = sws._stats;
+
+			int numV = sws._grid.numV;
+			totalCnt += SeedsFlowToMatches(sws._grid, sws._pydSeeds[0], sws._pydSeedsFlow[0], prevMatches, sws);
+			if (outMatches)
+				outMatches[v].copyData(prevMatches);
+			if (outDisp){
+				// the center from the first pair on the right (on the left without one)
+				if (k == 1 && (side == 1 || center + 1 >= nViews)){
+					ScaleSeedsFlow(sws._pydSeedsFlow[0], numV, 1.f / (v - center));
+					SeedsFlowToDense(sws._grid, sws._pydSeeds[0], sws._pydSeedsFlow[0], outDisp[center]);
+				}
+				ScaleSeedsFlow(sws._pydSeedsFlow2[0], numV, 1.f / (center - v));
+				SeedsFlowToDense(sws._grid, sws._pydSeeds[0], sws._pydSeedsFlow2[0], outDisp[v]);
+			}
+		}
+	}
+	return totalCnt;
+}
+
+void CPM::ScaleSeedsFlow(FImage& seedsFlow, int numV, float scale) const
 {
+	float* flowU = seedsFlow.rowPtr(0);
+	float* flowV = seedsFlow.rowPtr(1);
+	for (int i = 0; i < numV; i++){
+		if (abs(flowU[i]) < UNKNOWN_FLOW && abs(flowV[i]) < UNKNOWN_FLOW){
+			flowU[i] *= scale;
+			flowV[i] *= scale;
+		}
+	}
+}
+
+void CPM::ExtractFeatures(FImage& img, CPMFeatures& outFeats) const
+{
+	// ROI mode: only the part of the frame the ROI can be matched with
+	FImage* src = &img;
+	FImage roiImg;
+	outFeats._ox = outFeats._oy = 0;
+	if (_roiW > 0 && _roiH > 0){
+		int x0, y0, x1, y1;
+		ROIWindow(img.width(), img.height(), &x0, &y0, &x1, &y1);
+		img.crop(roiImg, x0, y0, x1 - x0, y1 - y0);
+		outFeats._ox = x0;
+		outFeats._oy = y0;
+		src = &roiImg;
+	}
+
+	double pydTimes[32];
+	BuildPyramid(*src, outFeats._pyd, pydTimes);
+
+	int nLevels = outFeats._pyd.nlevels();
+	assert(nLevels <= 32);
+	outFeats._pydTimes.assign(pydTimes, pydTimes + nLevels);
+	outFeats._ftTimes.assign(nLevels, 0);
+
+	// features of multi levels, the finer ones are computed tile by tile when matching
+	outFeats.AllocateLevels(nLevels);
+	int firstLevel = FirstGlobalLevel(outFeats._pyd);
+	for (int i = 0; i < firstLevel; i++){
+		outFeats._ftImgs[i].clear();
+	}
 	CTimer t;
+	if (_descDim > 0 && HasPCA()){
+		// compact descriptors, the full ones are only kept for the current level
+		UCImage daisy;
+		for (int i = firstLevel; i < nLevels; i++){
+			imDaisy(outFeats._pyd[i], daisy);
+			ProjectFeatures(daisy, outFeats._ftImgs[i]);
+			outFeats._ftTimes[i] = t.toc();
+		}
+		outFeats._costScale = _pcaCostScale;
+		return;
+	}
+	for (int i = firstLevel; i < nLevels; i++){
+		imDaisy(outFeats._pyd[i], outFeats._ftImgs[i]);
+		//ImageFeature::imSIFT(outFeats._pyd[i], outFeats._ftImgs[i], 2, 1, true, 8);
+		outFeats._ftTimes[i] = t.toc();
+	}
+	outFeats._costScale = 1;
+}
 
-	int w = img1.width();
-	int h = img1.height();
+void CPM::MatchSeeds(CPMFeatures& feats1, CPMFeatures& feats2, CPMWorkspace& ws, FImage* prevMatches) const
+{
+	MatchSeeds(feats1, feats2, ws, prevMatches, 1, _warmStartWarp != 0);
+}
 
-	_pyd1.ConstructPyramid(img1, _pydRatio, 30);
-	_pyd2.ConstructPyramid(img2, _pydRatio, 30);
+void CPM::MatchSeeds(CPMFeatures& feats1, CPMFeatures& feats2, CPMWorkspace& ws, FImage* prevMatches, float prevScale, bool prevWarp) const
+{
+	CTimer t;
+
+	assert(feats1.nlevels() == feats2.nlevels());
+	assert(feats1.width() == feats2.width() && feats1.height() == feats2.height());
+	assert(feats1._ox == feats2._ox && feats1._oy == feats2._oy);
+
+	int w = feats1.width();
+	int h = feats1.height();
 
-	int nLevels = _pyd1.nlevels();
+	int nLevels = feats1.nlevels();
+	// the coarsest level always has its features
+	assert(feats1._ftImgs[nLevels - 1].nchannels() == feats2._ftImgs[nLevels - 1].nchannels());
 
-	if (_im1f)
-		delete[] _im1f;
-	if (_im2f)
-		delete[] _im2f;
+	ws.AllocateLevels(nLevels);
+	ws._costScale = feats1._costScale;
+	ws._costEvalCount = 0;
+	ws._earlyRejectCount = 0;
 
-    //im1f, im2f are vectors storing features of multi levels
-	_im1f = new UCImage[nLevels];
-	_im2f = new UCImage[nLevels];
+	CPMStats& stats = ws._stats;
+	stats.Reset(nLevels);
 	for (int i = 0; i < nLevels; i++){
-        imDaisy(_pyd1[i], _im1f[i]);
-        imDaisy(_pyd2[i], _im2f[i]);
-        //ImageFeature::imSIFT(_pyd1[i], _im1f[i], 2, 1, true, 8);
-        //ImageFeature::imSIFT(_pyd2[i], _im2f[i], 2, 1, true, 8);
+		CPMLevelStats& st = stats.levels[i];
+		st.width = feats1._pyd[i].width();
+		st.height = feats1._pyd[i].height();
+		st.pyramidTime = feats1._pydTimes[i] + feats2._pydTimes[i];
+		st.featureTime = feats1._ftTimes[i] + feats2._ftTimes[i];
 	}
-	// t.toc("get feature: ");
 
 	int step = _step;
 	int gridw = w / step;
@@ -107,97 +807,149 @@ int CPM::Matching(FImage& img1, FImage& img2, FImage& outMatches)
 	int xoffset = (w - (gridw - 1)*step) / 2;
 	int yoffset = (h - (gridh - 1)*step) / 2;
 	int numV = gridw * gridh;
+	stats.numSeeds = numV;
+
+	CPMSeedGrid& grid = ws._grid;
+	grid.Set(gridw, gridh);
+	int stride = grid.stride;
 
-	if (_pydSeedsFlow)
-		delete[] _pydSeedsFlow;
-	if (_pydSeedsFlow2)
-		delete[] _pydSeedsFlow2;
-	_pydSeedsFlow = new FImage[nLevels];
-	_pydSeedsFlow2 = new FImage[nLevels];
 	for (int i = 0; i < nLevels; i++){
-		_pydSeedsFlow[i].allocate(2, numV);
-        _pydSeedsFlow2[i].allocate(2, numV);
+		if (!ws._pydSeedsFlow[i].matchDimension(stride, 2, 1))
+			ws._pydSeedsFlow[i].allocate(stride, 2);
+		if (!ws._pydSeedsFlow2[i].matchDimension(stride, 2, 1))
+			ws._pydSeedsFlow2[i].allocate(stride, 2);
 	}
 
-	_seeds.allocate(2, numV);
-	_neighbors.allocate(12, numV);
-	_neighbors.setValue(-1);
-	int nbOffset[8][2] = { { 0, -1 }, { 0, 1 }, { 1, 0 }, { -1, 0 }, { -1, -1 }, { -1, 1 }, { 1, -1 }, { 1, 1 } };
-    for (int i = 0; i < numV; i++){
-		int gridX = i % gridw;
-		int gridY = i / gridw;
-		_seeds[2 * i] = gridX * step + xoffset;
-		_seeds[2 * i + 1] = gridY * step + yoffset;
-		int nbIdx = 0;
-		for (int j = 0; j < 8; j++){
-			int nbGridX = gridX + nbOffset[j][0];
-			int nbGridY = gridY + nbOffset[j][1];
-			if (nbGridX < 0 || nbGridX >= gridw || nbGridY < 0 || nbGridY >= gridh)
-				continue;
-			_neighbors[i*_neighbors.width() + nbIdx] = nbGridY*gridw + nbGridX;
-			nbIdx++;
-		}
+	// seed positions at full resolution, the coarser levels are done in TwoPassesAndTwoChecks
+	IntImage& seeds = ws._pydSeeds[0];
+	if (!seeds.matchDimension(stride, 2, 1))
+		seeds.allocate(stride, 2);
+	int* seedsX = seeds.rowPtr(0);
+	int* seedsY = seeds.rowPtr(1);
+	for (int i = 0; i < numV; i++){
+		seedsX[i] = (i % gridw) * step + xoffset;
+		seedsY[i] = (i / gridw) * step + yoffset;
 	}
-	_seeds2.copy(_seeds);
-	_neighbors2.copy(_neighbors);
 
-	FImage seedsFlow(2, numV);
-    FImage seedsFlow2(2, numV);
+	// warm start: the flow f of a previous match at p (frame i-1 -> i), scaled by prevScale,
+	// is given to the forward seed nearest to p (or p + f when warping), and -f to the
+	// backward seed nearest to p + f (or p + 2f)
+	ws._warmStart = (prevMatches != NULL && prevMatches->height() > 0);
+	if (ws._warmStart){
+		if (!ws._warmFlow.matchDimension(stride, 2, 1)){
+			ws._warmFlow.allocate(stride, 2);
+			ws._warmFlow2.allocate(stride, 2);
+		}
+		ws._warmFlow.setValue(UNKNOWN_FLOW);
+		ws._warmFlow2.setValue(UNKNOWN_FLOW);
+		int cnt = prevMatches->height();
+		for (int i = 0; i < cnt; i++){
+			float* p = prevMatches->rowPtr(i);
+			float u = (p[2] - p[0]) * prevScale;
+			float v = (p[3] - p[1]) * prevScale;
+			float x = p[0], y = p[1];
+			if (prevWarp){
+				x = p[2]; y = p[3];
+			}
+			// matches are in frame coordinates
+			x -= feats1._ox;
+			y -= feats1._oy;
+			for (int dir = 0; dir < 2; dir++){
+				int gridX = floor((x - xoffset) / step + 0.5);
+				int gridY = floor((y - yoffset) / step + 0.5);
+				if (gridX >= 0 && gridX < gridw && gridY >= 0 && gridY < gridh){
+					FImage& warmFlow = (dir == 0) ? ws._warmFlow : ws._warmFlow2;
+					int idx = gridY*gridw + gridX;
+					warmFlow.rowPtr(0)[idx] = (dir == 0) ? u : -u;
+					warmFlow.rowPtr(1)[idx] = (dir == 0) ? v : -v;
+				}
+				x += u; y += v;
+			}
+		}
+	}
 
-	_kLabels.allocate(w, h);
+	IntImage& kLabels = ws._kLabels;
+	if (!kLabels.matchDimension(w, h, 1))
+		kLabels.allocate(w, h);
+	kLabels.reset();
 	for (int i = 0; i < numV; i++){
-		int x = _seeds[2 * i];
-		int y = _seeds[2 * i + 1];
+		int x = seedsX[i];
+		int y = seedsY[i];
 		int r = step / 2;
 		for (int ii = -r; ii <= r; ii++){
 			for (int jj = -r; jj <= r; jj++){
 				int xx = ImageProcessing::EnforceRange(x + ii, w);
 				int yy = ImageProcessing::EnforceRange(y + jj, h);
-				_kLabels[yy*w + xx] = i;
+				kLabels[yy*w + xx] = i;
 			}
 		}
 	}
-	_kLabels2.copy(_kLabels);
+	ws._kLabels2.copyData(kLabels);
 	//kLabels.imshow("kLabels", 0);
 
     //t.toc("generate seeds: ");
 
-    t.tic();
-    TwoPassesAndTwoChecks(_pyd1, _pyd2, _im1f, _im2f, _seeds, _seeds2, _neighbors, _neighbors2, _pydSeedsFlow, _pydSeedsFlow2);
-    t.toc();
-    seedsFlow.copyData(_pydSeedsFlow[0]);
+    TwoPassesAndTwoChecks(feats1._pyd, feats2._pyd, feats1._ftImgs, feats2._ftImgs, ws._pydSeedsFlow, ws._pydSeedsFlow2, ws);
+
+	// ROI mode: the seeds back to frame coordinates, only the ones inside the ROI are kept
+	if (_roiW > 0 && _roiH > 0){
+		float* flowU = ws._pydSeedsFlow[0].rowPtr(0);
+		float* flowV = ws._pydSeedsFlow[0].rowPtr(1);
+		float* flowU2 = ws._pydSeedsFlow2[0].rowPtr(0);
+		float* flowV2 = ws._pydSeedsFlow2[0].rowPtr(1);
+		for (int i = 0; i < numV; i++){
+			seedsX[i] += feats1._ox;
+			seedsY[i] += feats1._oy;
+			if (seedsX[i] < _roiX || seedsX[i] >= _roiX + _roiW || seedsY[i] < _roiY || seedsY[i] >= _roiY + _roiH){
+				flowU[i] = flowV[i] = UNKNOWN_FLOW;
+				flowU2[i] = flowV2[i] = UNKNOWN_FLOW;
+			}
+		}
+	}
+    stats.matchTime = t.toc();
 
 /*
 	t.tic();
-	OnePass(_pyd1, _pyd2, _im1f, _im2f, _seeds, _neighbors, _pydSeedsFlow);
+	OnePass(feats1._pyd, feats2._pyd, feats1._ftImgs, feats2._ftImgs, ws._pydSeedsFlow, ws);
 	t.toc("forward matching: ");
-    OnePass(_pyd2, _pyd1, _im2f, _im1f, _seeds2, _neighbors2, _pydSeedsFlow2);
+    OnePass(feats2._pyd, feats1._pyd, feats2._ftImgs, feats1._ftImgs, ws._pydSeedsFlow2, ws);
 	t.toc("backward matching: ");
 
     // cross check
     // cross check for finest level
     int* validFlag = new int[numV];
-    CrossCheck(_seeds, _pydSeedsFlow[0], _pydSeedsFlow2[0], _kLabels2, validFlag, _checkThreshold);
-    seedsFlow.copyData(_pydSeedsFlow[0]);
+    CrossCheck(grid, ws._pydSeeds[0], ws._pydSeedsFlow[0], ws._pydSeedsFlow2[0], ws._kLabels2, validFlag, _checkThreshold);
+    seedsFlow.copyData(ws._pydSeedsFlow[0]);
 	for (int i = 0; i < numV; i++){
         if (!validFlag[i]){
             //printf("bpOutliers!\n");
-            seedsFlow[2 * i] = UNKNOWN_FLOW;
-            seedsFlow[2 * i + 1] = UNKNOWN_FLOW;
+            seedsFlow.rowPtr(0)[i] = UNKNOWN_FLOW;
+            seedsFlow.rowPtr(1)[i] = UNKNOWN_FLOW;
         }
 	}
 	delete[] validFlag;
 */
+}
+
+int CPM::SeedsFlowToMatches(const CPMSeedGrid& grid, IntImage& seeds, FImage& seedsFlow, FImage& outMatches, CPMWorkspace& ws) const
+{
+	int numV = grid.numV;
+	const int* seedsX = seeds.rowPtr(0);
+	const int* seedsY = seeds.rowPtr(1);
+	const float* flowU = seedsFlow.rowPtr(0);
+	const float* flowV = seedsFlow.rowPtr(1);
 
 	// flow 2 match
-	FImage tmpMatch(4, numV);
+	FImage& tmpMatch = ws._tmpMatch;
+	if (!tmpMatch.matchDimension(4, numV, 1))
+		tmpMatch.allocate(4, numV);
 	tmpMatch.setValue(-1);
 	int validMatCnt = 0;
 	for (int i = 0; i < numV; i++){
-		int x = _seeds[2 * i];
-		int y = _seeds[2 * i + 1];
-		float u = seedsFlow[2 * i];
-		float v = seedsFlow[2 * i + 1];
+		int x = seedsX[i];
+		int y = seedsY[i];
+		float u = flowU[i];
+		float v = flowV[i];
 		float x2 = x + u;
 		float y2 = y + v;
 		if (abs(u) < UNKNOWN_FLOW && abs(v) < UNKNOWN_FLOW){
@@ -222,45 +974,141 @@ int CPM::Matching(FImage& img1, FImage& img2, FImage& outMatches)
 	return validMatCnt;
 }
 
-void CPM::imDaisy(FImage& img, UCImage& outFtImg)
+int CPM::SeedsFlowToDense(const CPMSeedGrid& grid, IntImage& seeds, FImage& seedsFlow, cv::Mat& out) const
+{
+	int numV = grid.numV;
+	const int* seedsX = seeds.rowPtr(0);
+	const int* seedsY = seeds.rowPtr(1);
+	const float* flowU = seedsFlow.rowPtr(0);
+	const float* flowV = seedsFlow.rowPtr(1);
+	int w = out.cols;
+	int h = out.rows;
+	int nch = out.channels();
+	assert(out.depth() == CV_32F && (nch == 1 || nch == 2));
+
+	int validCnt = 0;
+	for (int i = 0; i < numV; i++){
+		int x = seedsX[i];
+		int y = seedsY[i];
+		float u = flowU[i];
+		float v = flowV[i];
+		if (!(abs(u) < UNKNOWN_FLOW && abs(v) < UNKNOWN_FLOW)){
+			continue;
+		}
+		// same values as going through the matches (x2 - x1)
+		float x2 = x + u;
+		float y2 = y + v;
+		u = x2 - x;
+		v = y2 - y;
+		for (int di = -1; di <= 1; di++){
+			int ty = ImageProcessing::EnforceRange(y + di, h);
+			float* row = out.ptr<float>(ty);
+			for (int dj = -1; dj <= 1; dj++){
+				int tx = ImageProcessing::EnforceRange(x + dj, w);
+				row[tx * nch] = u;
+				if (nch == 2)
+					row[tx * nch + 1] = v;
+			}
+		}
+		validCnt++;
+	}
+	return validCnt;
+}
+
+void CPM::imDaisy(FImage& img, UCImage& outFtImg) const
 {
-	FImage imgray;
-	img.desaturate(imgray);
+	// same parameters as the OpenCV DAISY used before: R = 5, Q = 3, T = 4, H = 8
+	ImageFeature::imDAISY(img, outFtImg, 5, 3, 4, 8, FEATURE_ALIGN);
+}
 
-	int w = imgray.width();
-	int h = imgray.height();
+void CPM::CropFeatures(FImage& img, int x0, int y0, int x1, int y1, UCImage& outFtImg, CPMWorkspace& ws) const
+{
+	img.crop(ws._tileImg, x0, y0, x1 - x0, y1 - y0);
+	if (_descDim > 0 && HasPCA()){
+		imDaisy(ws._tileImg, ws._tileDaisy);
+		ProjectFeatures(ws._tileDaisy, outFtImg);
+	}else{
+		imDaisy(ws._tileImg, outFtImg);
+	}
+}
 
-	// use the version in OpenCV
-	cv::Ptr<cv::xfeatures2d::DAISY> daisy =
-		cv::xfeatures2d::DAISY::create(5, 3, 4, 8, 
-		cv::xfeatures2d::DAISY::NRM_FULL, cv::noArray(), false, false);
-	cv::Mat cvImg(h, w, CV_8UC1);
-	for (int i = 0; i < h; i++){
-		for (int j = 0; j < w; j++){
-			cvImg.at<unsigned char>(i, j) = imgray[i*w + j] * 255;
-		}
+void CPM::BuildPyramid(const FImage& img, FImagePyramid& pyd, double* outLevelTimes) const
+{
+	if (_binomialPyramid && _pydRatio == 0.5f)
+		pyd.ConstructPyramidBinomial(img, 30, outLevelTimes);
+	else
+		pyd.ConstructPyramid(img, _pydRatio, 30, outLevelTimes);
+}
+
+int CPM::FeatureChannels() const
+{
+	int dim = (_descDim > 0 && HasPCA()) ? _pcaBasis.rows : DAISY_DIM;
+	return (dim + FEATURE_ALIGN - 1) / FEATURE_ALIGN * FEATURE_ALIGN;
+}
+
+int CPM::FirstGlobalLevel(FImagePyramid& pyd) const
+{
+	int nLevels = pyd.nlevels();
+	if (_tileMemory <= 0)
+		return 0;
+
+	// the coarsest level is always global, the others while they take at most half of the
+	// budget, the other half is left to the tiles
+	double budget = _tileMemory * 1024. * 1024. / 2;
+	int ch = FeatureChannels();
+	int l = nLevels - 1;
+	double kept = 2. * pyd[l].npixels() * ch;
+	for (; l > 0; l--){
+		double npix = pyd[l - 1].npixels();
+		if (kept + 2 * npix * ch + npix * DAISY_WORK_BYTES > budget)
+			break;
+		kept += 2 * npix * ch;
 	}
-	cv::Mat outFeatures;
-	daisy->compute(cvImg, outFeatures);
+	return l;
+}
 
-	int itSize = outFeatures.cols;
-	outFtImg.allocate(w, h, itSize);
-	for (int i = 0; i < h; i++){
-		for (int j = 0; j < w; j++){
-			int idx = i*w + j;
-			for (int k = 0; k < itSize; k++){
-				outFtImg.pData[idx*itSize + k] = outFeatures.at<float>(idx, k) * 255;
-			}
-		}
+void CPM::ROIWindow(int w, int h, int* x0, int* y0, int* x1, int* y1) const
+{
+	// a match of a ROI seed lands within the max displacement, the DAISY footprint
+	// keeps the features there the same as on the whole frame
+	int margin = _maxDisplacement + ImageFeature::DAISYFootprint(5, 3);
+	*x0 = __max(_roiX - margin, 0);
+	*y0 = __max(_roiY - margin, 0);
+	*x1 = __min(_roiX + _roiW + margin, w);
+	*y1 = __min(_roiY + _roiH + margin, h);
+	// at least two levels above the minimum pyramid width
+	int minSize = 4 * 30;
+	if (*x1 - *x0 < minSize){
+		*x0 = __max(__min(*x0, w - minSize), 0);
+		*x1 = __min(*x0 + minSize, w);
+	}
+	if (*y1 - *y0 < minSize){
+		*y0 = __max(__min(*y0, h - minSize), 0);
+		*y1 = __min(*y0 + minSize, h);
 	}
 }
 
-void CPM::CrossCheck(IntImage& seeds, FImage& seedsFlow, FImage& seedsFlow2, IntImage& kLabel2, int* valid, float th)
+void CPM::CrossCheck(const CPMSeedGrid& grid, IntImage& seeds, FImage& seedsFlow, FImage& seedsFlow2, IntImage& kLabel2, int* valid, float th) const
+{
+	if (_isStereo)
+		CrossCheckT<true>(grid, seeds, seedsFlow, seedsFlow2, kLabel2, valid, th);
+	else
+		CrossCheckT<false>(grid, seeds, seedsFlow, seedsFlow2, kLabel2, valid, th);
+}
+
+template <bool Stereo>
+void CPM::CrossCheckT(const CPMSeedGrid& grid, IntImage& seeds, FImage& seedsFlow, FImage& seedsFlow2, IntImage& kLabel2, int* valid, float th) const
 {
     //printf("bpcheck!\n");
 	int w = kLabel2.width();
 	int h = kLabel2.height();
-	int numV = seeds.height();
+	int numV = grid.numV;
+	const int* seedsX = seeds.rowPtr(0);
+	const int* seedsY = seeds.rowPtr(1);
+	const float* flowU = seedsFlow.rowPtr(0);
+	const float* flowV = seedsFlow.rowPtr(1);
+	const float* flowU2 = seedsFlow2.rowPtr(0);
+	const float* flowV2 = seedsFlow2.rowPtr(1);
     for (int i = 0; i < numV; i++){
          valid[i] = 1;
      }
@@ -268,24 +1116,29 @@ void CPM::CrossCheck(IntImage& seeds, FImage& seedsFlow, FImage& seedsFlow2, Int
 	// cross check (1st step)
 	int b = _borderWidth;
 	for (int i = 0; i < numV; i++){
-		float u = seedsFlow[2 * i];
-		float v = seedsFlow[2 * i + 1];
-		int x = seeds[2 * i];
-		int y = seeds[2 * i + 1];
+		float u = flowU[i];
+		float v = Stereo ? 0 : flowV[i];
+		int x = seedsX[i];
+		int y = seedsY[i];
 		int x2 = x + u;
-		int y2 = y + v;
+		int y2 = Stereo ? y : y + v;
 		if (x < b || x >= w - b || y < b || y >= h - b
 			|| x2 < b || x2 >= w - b || y2 < b || y2 >= h - b
-            || sqrt(u*u + v*v)>_maxDisplacement){
+            || (Stereo ? fabs(u) : sqrt(u*u + v*v)) > _maxDisplacement){
             valid[i] = 0;
             //printf("bpOut1!\n");
 			continue;
 		}
 
 		int idx2 = kLabel2[y2*w + x2];
-		float u2 = seedsFlow2[2 * idx2];
-		float v2 = seedsFlow2[2 * idx2 + 1];
-		float diff = sqrt((u + u2)*(u + u2) + (v + v2)*(v + v2));
+		float u2 = flowU2[idx2];
+		float diff;
+		if (Stereo){
+			diff = fabs(u + u2);
+		}else{
+			float v2 = flowV2[idx2];
+			diff = sqrt((u + u2)*(u + u2) + (v + v2)*(v + v2));
+		}
 		if (diff > th){
             //printf("bpOut2!\n");
             valid[i] = 0;
@@ -295,11 +1148,20 @@ void CPM::CrossCheck(IntImage& seeds, FImage& seedsFlow, FImage& seedsFlow2, Int
 }
 
 
-void CPM::CostCheck(IntImage& seeds, float* bestCosts, float* bestCosts2, IntImage& kLabel2, int* valid, float th)
+// number of seeds flagged invalid
+static int CountInvalid(const int* valid, int numV)
+{
+	int cnt = 0;
+	for (int i = 0; i < numV; i++){
+		cnt += !valid[i];
+	}
+	return cnt;
+}
+
+void CPM::CostCheck(int numV, float* bestCosts, float* bestCosts2, IntImage& kLabel2, int* valid, float th) const
 {
     //int w = kLabel2.width();
     //int h = kLabel2.height();
-    int numV = seeds.height();
     //for (int i = 0; i < numV; i++){
     //    valid[i] = 1;
     //}
@@ -315,82 +1177,423 @@ void CPM::CostCheck(IntImage& seeds, float* bestCosts, float* bestCosts2, IntIma
 }
 
 
-float CPM::MatchCost(FImage& img1, FImage& img2, UCImage* im1f, UCImage* im2f, int x1, int y1, int x2, int y2)
+float CPM::MatchCost(const FImageView& img1, const FImageView& img2, const CPMFeatureWindow& im1f, const CPMFeatureWindow& im2f, int x1, int y1, int x2, int y2) const
 {
-	int w = im1f->width();
-	int h = im1f->height();
-	int ch = im1f->nchannels();
+	int ch = im1f.nchannels();
 	float totalDiff;
 
 	// fast
-	x1 = ImageProcessing::EnforceRange(x1, w);
-	x2 = ImageProcessing::EnforceRange(x2, w);
-	y1 = ImageProcessing::EnforceRange(y1, h);
-	y2 = ImageProcessing::EnforceRange(y2, h);
-
-	unsigned char* p1 = im1f->pixPtr(y1, x1);
-	unsigned char* p2 = im2f->pixPtr(y2, x2);
+	unsigned char* p1 = im1f.pixPtr(x1, y1);
+	unsigned char* p2 = im2f.pixPtr(x2, y2);
+	if (!p1 || !p2){
+		// out of the window of a tile
+		return FLT_MAX;
+	}
 
+#ifdef WITH_SSE
+	if (ch % FEATURE_ALIGN == 0){
+		totalDiff = g_sadAligned(p1, p2, ch);
+	}else{
+		totalDiff = SadSSE2(p1, p2, ch);
+	}
+#else
 	totalDiff = 0;
+	for (int idx = 0; idx < ch; idx++){
+		totalDiff += abs(p1[idx] - p2[idx]);
+	}
+#endif
+
+	return totalDiff;
+}
+
+float CPM::MatchCostBounded(const FImageView& img1, const FImageView& img2, const CPMFeatureWindow& im1f, const CPMFeatureWindow& im2f, int x1, int y1, int x2, int y2, float bound, bool* earlyStop) const
+{
+	int ch = im1f.nchannels();
+	int totalDiff;
+
+	unsigned char* p1 = im1f.pixPtr(x1, y1);
+	unsigned char* p2 = im2f.pixPtr(x2, y2);
+	if (!p1 || !p2){
+		*earlyStop = false;
+		return FLT_MAX;
+	}
+
+	// the costs are integers, a partial sum reaching ceil(bound) can not end below bound
+	int iBound = (bound < (float)INT_MAX) ? (int)ceil(bound) : INT_MAX;
 
 #ifdef WITH_SSE
-	// SSE2
-	unsigned char *_p1 = p1, *_p2 = p2;
-	hu_m128 r1, r2, r3;
-	int iterCnt = ch / 16;
-	int idx = 0;
-	int sum0 = 0;
-	int sum1 = 0;
-	for (idx = 0; idx < iterCnt; idx++){
-		memcpy(&r1, _p1, sizeof(hu_m128));
-		memcpy(&r2, _p2, sizeof(hu_m128));
-		_p1 += sizeof(hu_m128);
-		_p2 += sizeof(hu_m128);
-		r3.mi = _mm_sad_epu8(r1.mi, r2.mi);
-		sum0 += r3.m128i_u16[0];
-		sum1 += r3.m128i_u16[4];
-	}
-	totalDiff += sum0;
-	totalDiff += sum1;
-	// add the left
-	for (idx *= 16; idx < ch; idx++){
-		totalDiff += abs(p1[idx] - p2[idx]);
+	if (ch % FEATURE_ALIGN == 0){
+		totalDiff = g_sadBoundedAligned(p1, p2, ch, iBound, earlyStop);
+	}else{
+		totalDiff = SadSSE2Bounded(p1, p2, ch, iBound, earlyStop);
 	}
 #else
 	totalDiff = 0;
+	*earlyStop = false;
 	for (int idx = 0; idx < ch; idx++){
 		totalDiff += abs(p1[idx] - p2[idx]);
+		if ((idx & 15) == 15 && totalDiff >= iBound){
+			*earlyStop = (idx + 1 < ch);
+			break;
+		}
 	}
 #endif
 
 	return totalDiff;
 }
 
-int CPM::Propogate(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* pyd1f, UCImage* pyd2f, int level, float* radius, int iterCnt, IntImage* pydSeeds, IntImage& neighbors, FImage* pydSeedsFlow, float* bestCosts)
+// Counter-based random numbers: each seed gets its own generator, keyed by the seed
+// index, the direction of the matching (stream), the level and the iteration. The
+// draws do not depend on the order the seeds are visited in, nor on the number of
+// threads, and no global state (or lock) is involved.
+// The initialization of the coarsest level uses level = nLevels.
+static inline unsigned int MixBits(unsigned int h)
 {
-	int nLevels = pyd1.nlevels();
-	float ratio = pyd1.ratio();
+	h ^= h >> 16; h *= 0x7FEB352Du;
+	h ^= h >> 15; h *= 0x846CA68Bu;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline unsigned int HashSeed(unsigned int seed, unsigned int stream, unsigned int level, unsigned int iter)
+{
+	unsigned int key = MixBits((stream << 24) ^ (level << 16) ^ iter);
+	unsigned int h = MixBits(seed * 0x9E3779B1u + key);
+	return h ? h : 1; // xorshift has to start from a non zero state
+}
+
+static inline int NextRandom(unsigned int* state)
+{
+	// xorshift32
+	unsigned int x = *state;
+	x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+	*state = x;
+	return x >> 1;
+}
+
+template <bool Stereo>
+bool CPM::PropogateSeed(const FImageView& im1, const FImageView& im2, const CPMFeatureWindow& im1f, const CPMFeatureWindow& im2f, int idx, IntImage* seeds, const CPMSeedGrid& grid, FImage* seedsFlow, float* bestCosts, float radius, int* vFlags, unsigned int* rngState, long long& evalCount, long long& rejectCount) const
+{
+	bool updateFlag = false;
+	bool earlyStop;
+
+	int x = seeds->rowPtr(0)[idx];
+	int y = seeds->rowPtr(1)[idx];
+	float* flowU = seedsFlow->rowPtr(0);
+	float* flowV = seedsFlow->rowPtr(1);
+
+	int gridX = idx % grid.gridw;
+	int gridY = idx / grid.gridw;
+	bool inner = grid.IsInner(gridX, gridY);
+	// Propagation: Improve current guess by trying instead correspondences from neighbors
+	for (int k = 0; k < 8; k++){
+		int nb = inner ? idx + grid.nbDelta[k] : grid.Neighbor(idx, gridX, gridY, k);
+		if (nb < 0){
+			continue;
+		}
+		if (!vFlags[nb]){ // unvisited yet
+			continue;
+		}
+		float tu = flowU[nb];
+		float cu = flowU[idx];
+		float tv = 0;
+		if (Stereo){
+			if (abs(tu - cu) < 1e-6){
+				continue;
+			}
+		}else{
+			tv = flowV[nb];
+			float cv = flowV[idx];
+			if (abs(tu - cu) < 1e-6 && abs(tv - cv) < 1e-6){
+				continue;
+			}
+		}
+		float tc = MatchCostBounded(im1, im2, im1f, im2f, x, y, x + tu, Stereo ? y : y + tv, bestCosts[idx], &earlyStop);
+		evalCount++;
+		rejectCount += earlyStop;
+		if (tc < bestCosts[idx]){
+			bestCosts[idx] = tc;
+			flowU[idx] = tu;
+			if (!Stereo)
+				flowV[idx] = tv;
+			updateFlag = true;
+		}
+	}
+
+	// Random search: Improve current guess by searching in boxes
+	// of exponentially decreasing size around the current best guess.
+	for (int mag = radius + 0.5; mag >= 1; mag /= 2) {
+		/* Sampling window */
+		float tu = flowU[idx] + NextRandom(rngState) % (2 * mag + 1) - mag;
+
+		float tv = 0;
+		if (!Stereo){
+			tv = flowV[idx] + NextRandom(rngState) % (2 * mag + 1) - mag;
+		}
+
+		float cu = flowU[idx];
+		if (Stereo){
+			if (abs(tu - cu) < 1e-6){
+				continue;
+			}
+		}else{
+			float cv = flowV[idx];
+			if (abs(tu - cu) < 1e-6 && abs(tv - cv) < 1e-6){
+				continue;
+			}
+		}
+
+		float tc = MatchCostBounded(im1, im2, im1f, im2f, x, y, x + tu, Stereo ? y : y + tv, bestCosts[idx], &earlyStop);
+		evalCount++;
+		rejectCount += earlyStop;
+		if (tc < bestCosts[idx]){
+			bestCosts[idx] = tc;
+			flowU[idx] = tu;
+			if (!Stereo)
+				flowV[idx] = tv;
+			updateFlag = true;
+		}
+	}
+	vFlags[idx] = 1;
 
-	FImage im1 = pyd1[level];
-	FImage im2 = pyd2[level];
-	UCImage* im1f = pyd1f + level;
-	UCImage* im2f = pyd2f + level;
+	return updateFlag;
+}
+
+int CPM::Propogate(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* pyd1f, UCImage* pyd2f, int level, float* radius, int iterCnt, IntImage* pydSeeds, const CPMSeedGrid& grid, FImage* pydSeedsFlow, float* bestCosts, float* radius2, FImage* pydSeedsFlow2, float* bestCosts2, int* iter2, CPMWorkspace& ws) const
+{
+	CPMLevelStats& st = ws._stats.levels[level];
+	double featureTime = st.featureTime;
+	int nStreams = radius2 ? 2 : 1;
+	for (int d = 0; d < nStreams; d++){
+		ws._iterUpdates[d].assign(_maxIters, 0);
+		ws._iterSeeds[d].assign(_maxIters, 0);
+		ws._streamEvalCount[d] = 0;
+		ws._streamRejectCount[d] = 0;
+	}
+	CTimer t;
+
+	int iters[2] = { 0, 0 };
+	if (pyd1f[level].IsEmpty() || pyd2f[level].IsEmpty()){
+		// tiled level, with what the features of the global levels leave of the budget
+		double budget = _tileMemory * 1024. * 1024.;
+		for (int l = 0; l < pyd1.nlevels(); l++){
+			budget -= pyd1f[l].nelements() + pyd2f[l].nelements();
+		}
+		memset(ws._vFlags.pData, 0, sizeof(int)*grid.numV);
+		PropogateTile(pyd1, pyd2, level, 0, 0, grid.gridw, grid.gridh, budget, pydSeeds, grid, radius, pydSeedsFlow, bestCosts, radius2, pydSeedsFlow2, bestCosts2, 0, iters, ws);
+	}else{
+		FImageView im1(pyd1[level]);
+		FImageView im2(pyd2[level]);
+		CPMFeatureWindow im1f(pyd1f[level]);
+		CPMFeatureWindow im2f(pyd2f[level]);
+		if (_isStereo)
+			iters[0] = PropogateT<true>(im1, im2, im1f, im2f, level, radius, 0, 0, grid.gridw, grid.gridh, pydSeeds, grid, pydSeedsFlow, bestCosts, 0, ws);
+		else
+			iters[0] = PropogateT<false>(im1, im2, im1f, im2f, level, radius, 0, 0, grid.gridw, grid.gridh, pydSeeds, grid, pydSeedsFlow, bestCosts, 0, ws);
+		if (radius2){
+			if (_isStereo)
+				iters[1] = PropogateT<true>(im2, im1, im2f, im1f, level, radius2, 0, 0, grid.gridw, grid.gridh, pydSeeds, grid, pydSeedsFlow2, bestCosts2, 1, ws);
+			else
+				iters[1] = PropogateT<false>(im2, im1, im2f, im1f, level, radius2, 0, 0, grid.gridw, grid.gridh, pydSeeds, grid, pydSeedsFlow2, bestCosts2, 1, ws);
+		}
+	}
+
+	// the tile features are counted with the other features
+	st.propagationTime += t.toc() - (st.featureTime - featureTime);
+	for (int d = 0; d < nStreams; d++){
+		st.iterations[d] = iters[d];
+		st.updateRatios[d].clear();
+		for (int i = 0; i < iters[d]; i++){
+			st.updateRatios[d].push_back(ws._iterSeeds[d][i] > 0 ? float(ws._iterUpdates[d][i]) / ws._iterSeeds[d][i] : 0.f);
+		}
+		// every seed gets an initial cost
+		st.matchCostCalls[d] = grid.numV + ws._streamEvalCount[d];
+		st.earlyRejects[d] = ws._streamRejectCount[d];
+	}
+	if (iter2)
+		*iter2 = iters[1];
+	return iters[0];
+}
+
+void CPM::PropogateTile(FImagePyramid& pyd1, FImagePyramid& pyd2, int level, int gx0, int gy0, int gx1, int gy1, double budget, IntImage* pydSeeds, const CPMSeedGrid& grid, float* radius, FImage* pydSeedsFlow, float* bestCosts, float* radius2, FImage* pydSeedsFlow2, float* bestCosts2, int stream, int* iters, CPMWorkspace& ws) const
+{
+	FImage& img1 = pyd1[level];
+	FImage& img2 = pyd2[level];
+	int w = img1.width();
+	int h = img1.height();
+	int gridw = grid.gridw;
+	int gridh = grid.gridh;
+	const int* seedsX = pydSeeds[level].rowPtr(0);
+	const int* seedsY = pydSeeds[level].rowPtr(1);
+	int nStreams = radius2 ? 2 : 1;
+	float* radii[2] = { radius, radius2 };
+	FImage* flows[2] = { pydSeedsFlow + level, radius2 ? pydSeedsFlow2 + level : NULL };
+
+	// the seeds of the tile, at the same place in both images
+	int minX = INT_MAX, maxX = INT_MIN, minY = INT_MAX, maxY = INT_MIN;
+	float maxR[2] = { 0, 0 };
+	for (int gy = gy0; gy < gy1; gy++){
+		for (int gx = gx0; gx < gx1; gx++){
+			int idx = gy*gridw + gx;
+			minX = __min(minX, seedsX[idx]);
+			maxX = __max(maxX, seedsX[idx]);
+			minY = __min(minY, seedsY[idx]);
+			maxY = __max(maxY, seedsY[idx]);
+			for (int d = 0; d < nStreams; d++){
+				maxR[d] = __max(maxR[d], radii[d][idx]);
+			}
+		}
+	}
+	int r = ceil(__max(maxR[0], maxR[1]));
+
+	// crops with the DAISY footprint around the windows (same parameters as imDaisy),
+	// so that the features inside them are the same as the ones of the whole level
+	int margin = ImageFeature::DAISYFootprint(5, 3);
+	int c1x0 = __max(minX - margin, 0), c1x1 = __min(maxX + 1 + margin, w);
+	int c1y0 = __max(minY - margin, 0), c1y1 = __min(maxY + 1 + margin, h);
+
+	// the window in image 2 is at least as large as the tile widened by the search radius
+	int ch = FeatureChannels();
+	double area1 = double(c1x1 - c1x0) * (c1y1 - c1y0);
+	double area2 = double(c1x1 - c1x0 + 2 * r) * (c1y1 - c1y0 + 2 * r);
+	if ((area1 + area2) * ch + area2 * DAISY_WORK_BYTES > budget && (gx1 - gx0 > 1 || gy1 - gy0 > 1)){
+		// too large, the two halves one after the other
+		if (gx1 - gx0 >= gy1 - gy0){
+			int gm = (gx0 + gx1) / 2;
+			PropogateTile(pyd1, pyd2, level, gx0, gy0, gm, gy1, budget, pydSeeds, grid, radius, pydSeedsFlow, bestCosts, radius2, pydSeedsFlow2, bestCosts2, stream, iters, ws);
+			PropogateTile(pyd1, pyd2, level, gm, gy0, gx1, gy1, budget, pydSeeds, grid, radius, pydSeedsFlow, bestCosts, radius2, pydSeedsFlow2, bestCosts2, stream, iters, ws);
+		}else{
+			int gm = (gy0 + gy1) / 2;
+			PropogateTile(pyd1, pyd2, level, gx0, gy0, gx1, gm, budget, pydSeeds, grid, radius, pydSeedsFlow, bestCosts, radius2, pydSeedsFlow2, bestCosts2, stream, iters, ws);
+			PropogateTile(pyd1, pyd2, level, gx0, gm, gx1, gy1, budget, pydSeeds, grid, radius, pydSeedsFlow, bestCosts, radius2, pydSeedsFlow2, bestCosts2, stream, iters, ws);
+		}
+		return;
+	}
+
+	// where the seeds land with the flows of a direction and the ones of their neighbors
+	// (the propagation candidates), widened by the random search radius. A few outliers
+	// can make it much larger than the tile: it is then reduced to what the budget leaves,
+	// around the median target of the tile. The candidates out of it can not be matched.
+	double maxArea2 = __max((budget - area1 * ch) / (ch + DAISY_WORK_BYTES), area1);
+	int tx0[2], tx1[2], ty0[2], ty1[2];
+	for (int d = 0; d < nStreams; d++){
+		const float* flowU = flows[d]->rowPtr(0);
+		const float* flowV = flows[d]->rowPtr(1);
+		int rd = ceil(maxR[d]);
+		float minU = FLT_MAX, maxU = -FLT_MAX, minV = FLT_MAX, maxV = -FLT_MAX;
+		for (int gy = __max(gy0 - 1, 0); gy < __min(gy1 + 1, gridh); gy++){
+			for (int gx = __max(gx0 - 1, 0); gx < __min(gx1 + 1, gridw); gx++){
+				int idx = gy*gridw + gx;
+				minU = __min(minU, flowU[idx]);
+				maxU = __max(maxU, flowU[idx]);
+				minV = __min(minV, flowV[idx]);
+				maxV = __max(maxV, flowV[idx]);
+			}
+		}
+		tx0[d] = ImageProcessing::EnforceRange(minX + (int)floor(minU) - rd, w);
+		tx1[d] = ImageProcessing::EnforceRange(maxX + (int)ceil(maxU) + rd, w) + 1;
+		ty0[d] = ImageProcessing::EnforceRange(minY + (int)floor(minV) - rd, h);
+		ty1[d] = ImageProcessing::EnforceRange(maxY + (int)ceil(maxV) + rd, h) + 1;
+
+		double cropW = tx1[d] - tx0[d] + 2 * margin;
+		double cropH = ty1[d] - ty0[d] + 2 * margin;
+		if (cropW * cropH > maxArea2){
+			std::vector<int> targetX, targetY;
+			for (int gy = gy0; gy < gy1; gy++){
+				for (int gx = gx0; gx < gx1; gx++){
+					int idx = gy*gridw + gx;
+					targetX.push_back(ImageProcessing::EnforceRange(seedsX[idx] + (int)flowU[idx], w));
+					targetY.push_back(ImageProcessing::EnforceRange(seedsY[idx] + (int)flowV[idx], h));
+				}
+			}
+			int mid = targetX.size() / 2;
+			std::nth_element(targetX.begin(), targetX.begin() + mid, targetX.end());
+			std::nth_element(targetY.begin(), targetY.begin() + mid, targetY.end());
+			double scale = sqrt(maxArea2 / (cropW * cropH));
+			int tw = __max(int(cropW * scale) - 2 * margin, 1);
+			int th = __max(int(cropH * scale) - 2 * margin, 1);
+			int x0 = __max(__min(targetX[mid] - tw / 2, tx1[d] - tw), tx0[d]);
+			int y0 = __max(__min(targetY[mid] - th / 2, ty1[d] - th), ty0[d]);
+			tx1[d] = __min(x0 + tw, tx1[d]);
+			ty1[d] = __min(y0 + th, ty1[d]);
+			tx0[d] = x0;
+			ty0[d] = y0;
+		}
+	}
+
+	// image 2 holds the targets of the forward direction, image 1 the ones of the backward
+	// one. When both are matched, a crop covers the seeds as well so that the features of
+	// the tile are computed once for the two directions.
+	int c2x0 = __max(tx0[0] - margin, 0), c2x1 = __min(tx1[0] + margin, w);
+	int c2y0 = __max(ty0[0] - margin, 0), c2y1 = __min(ty1[0] + margin, h);
+	if (nStreams == 2){
+		int b1x0 = __min(c1x0, __max(tx0[1] - margin, 0)), b1x1 = __max(c1x1, __min(tx1[1] + margin, w));
+		int b1y0 = __min(c1y0, __max(ty0[1] - margin, 0)), b1y1 = __max(c1y1, __min(ty1[1] + margin, h));
+		int b2x0 = __min(c1x0, c2x0), b2x1 = __max(c1x1, c2x1);
+		int b2y0 = __min(c1y0, c2y0), b2y1 = __max(c1y1, c2y1);
+		double b1 = double(b1x1 - b1x0) * (b1y1 - b1y0);
+		double b2 = double(b2x1 - b2x0) * (b2y1 - b2y0);
+		if ((b1 + b2) * ch + __max(b1, b2) * DAISY_WORK_BYTES > budget){
+			// the two crops do not fit together (large targets): the directions one after
+			// the other, each with its own crops
+			PropogateTile(pyd1, pyd2, level, gx0, gy0, gx1, gy1, budget, pydSeeds, grid, radius, pydSeedsFlow, bestCosts, NULL, NULL, NULL, 0, iters, ws);
+			PropogateTile(pyd2, pyd1, level, gx0, gy0, gx1, gy1, budget, pydSeeds, grid, radius2, pydSeedsFlow2, bestCosts2, NULL, NULL, NULL, 1, iters, ws);
+			return;
+		}
+		c1x0 = b1x0; c1x1 = b1x1; c1y0 = b1y0; c1y1 = b1y1;
+		c2x0 = b2x0; c2x1 = b2x1; c2y0 = b2y0; c2y1 = b2y1;
+	}
+
+	CTimer t;
+	CropFeatures(img1, c1x0, c1y0, c1x1, c1y1, ws._tileFt1, ws);
+	CropFeatures(img2, c2x0, c2y0, c2x1, c2y1, ws._tileFt2, ws);
+	ws._stats.levels[level].featureTime += t.toc();
+
+	FImageView im1(img1);
+	FImageView im2(img2);
+	CPMFeatureWindow im1f(ws._tileFt1, c1x0, c1y0, minX, minY, maxX + 1, maxY + 1, w, h);
+	CPMFeatureWindow im2f(ws._tileFt2, c2x0, c2y0, tx0[0], ty0[0], tx1[0], ty1[0], w, h);
+	int iter;
+	if (_isStereo)
+		iter = PropogateT<true>(im1, im2, im1f, im2f, level, radius, gx0, gy0, gx1, gy1, pydSeeds, grid, pydSeedsFlow, bestCosts, stream, ws);
+	else
+		iter = PropogateT<false>(im1, im2, im1f, im2f, level, radius, gx0, gy0, gx1, gy1, pydSeeds, grid, pydSeedsFlow, bestCosts, stream, ws);
+	iters[stream] = __max(iters[stream], iter);
+	if (nStreams == 1)
+		return;
+
+	// backward: the seeds in the crop of image 2, the targets in the one of image 1
+	CPMFeatureWindow im2s(ws._tileFt2, c2x0, c2y0, minX, minY, maxX + 1, maxY + 1, w, h);
+	CPMFeatureWindow im1t(ws._tileFt1, c1x0, c1y0, tx0[1], ty0[1], tx1[1], ty1[1], w, h);
+	if (_isStereo)
+		iter = PropogateT<true>(im2, im1, im2s, im1t, level, radius2, gx0, gy0, gx1, gy1, pydSeeds, grid, pydSeedsFlow2, bestCosts2, 1, ws);
+	else
+		iter = PropogateT<false>(im2, im1, im2s, im1t, level, radius2, gx0, gy0, gx1, gy1, pydSeeds, grid, pydSeedsFlow2, bestCosts2, 1, ws);
+	iters[1] = __max(iters[1], iter);
+}
+
+template <bool Stereo>
+int CPM::PropogateT(const FImageView& im1, const FImageView& im2, const CPMFeatureWindow& im1f, const CPMFeatureWindow& im2f, int level, float* radius, int gx0, int gy0, int gx1, int gy1, IntImage* pydSeeds, const CPMSeedGrid& grid, FImage* pydSeedsFlow, float* bestCosts, int stream, CPMWorkspace& ws) const
+{
 	IntImage* seeds = pydSeeds + level;
 	FImage* seedsFlow = pydSeedsFlow + level;
 
-	int w = im1.width();
-	int h = im1.height();
-	int ptNum = seeds->height();
+	int gridw = grid.gridw;
+	int rectW = gx1 - gx0;
+	int ptNum = rectW * (gy1 - gy0);
 
-	int maxNb = neighbors.width();
-	int* vFlags = new int[ptNum];
+	int* vFlags = ws._vFlags.pData;
+	long long evalStart = ws._costEvalCount;
+	long long rejectStart = ws._earlyRejectCount;
 
 	// init cost
-	for (int i = 0; i < ptNum; i++){
-		int x = seeds->pData[2 * i];
-		int y = seeds->pData[2 * i + 1];
-		float u = seedsFlow->pData[2 * i];
-		float v = seedsFlow->pData[2 * i + 1];
+	#pragma omp parallel for if(_parallelPropagation)
+	for (int k = 0; k < ptNum; k++){
+		int i = (gy0 + k / rectW) * gridw + gx0 + k % rectW;
+		int x = seeds->rowPtr(0)[i];
+		int y = seeds->rowPtr(1)[i];
+		float u = seedsFlow->rowPtr(0)[i];
+		float v = seedsFlow->rowPtr(1)[i];
 		bestCosts[i] = MatchCost(im1, im2, im1f, im2f, x, y, x + u, y + v);
 	}
 
@@ -400,79 +1603,47 @@ int CPM::Propogate(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* pyd1f, UCI
 	{
 		int updateCount = 0;
 
-		memset(vFlags, 0, sizeof(int)*ptNum);
-
-		int startPos = 0, endPos = ptNum, step = 1;
-		if (iter % 2 == 1){
-			startPos = ptNum - 1; endPos = -1; step = -1;
+		for (int gy = gy0; gy < gy1; gy++){
+			memset(vFlags + gy*gridw + gx0, 0, sizeof(int)*rectW);
 		}
-		for (int pos = startPos; pos != endPos; pos += step){
-			bool updateFlag = false;
-
-			int idx = pos;
-
-			int x = seeds->pData[2 * idx];
-			int y = seeds->pData[2 * idx + 1];
 
-			int* nbIdx = neighbors.rowPtr(idx);
-			// Propagation: Improve current guess by trying instead correspondences from neighbors
-			for (int i = 0; i < maxNb; i++){
-				if (nbIdx[i] < 0){
-					break;
-				}
-				if (!vFlags[nbIdx[i]]){ // unvisited yet
-					continue;
-				}
-				float tu = seedsFlow->pData[2 * nbIdx[i]];
-				float tv = seedsFlow->pData[2 * nbIdx[i] + 1];
-				float cu = seedsFlow->pData[2 * idx];
-				float cv = seedsFlow->pData[2 * idx + 1];
-				if (abs(tu - cu) < 1e-6 && abs(tv - cv) < 1e-6){
-					continue;
-				}
-				float tc = MatchCost(im1, im2, im1f, im2f, x, y, x + tu, y + tv);
-				if (tc < bestCosts[idx]){
-					bestCosts[idx] = tc;
-					seedsFlow->pData[2 * idx] = tu;
-					seedsFlow->pData[2 * idx + 1] = tv;
-					updateFlag = true;
+		if (_parallelPropagation){
+			// neighbors are 8-connected, so two seeds with the same grid parity (color) never
+			// see each other: the 4 colors one after the other, each color on all threads.
+			// A seed only sees the colors already done, in reverse order every other iteration
+			long long evalCount = 0, rejectCount = 0;
+			for (int c = 0; c < 4; c++){
+				int color = (iter % 2 == 1) ? 3 - c : c;
+				// first seed of the color in the rectangle
+				int cx0 = gx0 + ((color % 2 - gx0) & 1);
+				int cy0 = gy0 + ((color / 2 - gy0) & 1);
+				int colorW = (gx1 - cx0 + 1) / 2;
+				int colorCnt = colorW * ((gy1 - cy0 + 1) / 2);
+				#pragma omp parallel for schedule(dynamic, 64) reduction(+:updateCount, evalCount, rejectCount)
+				for (int k = 0; k < colorCnt; k++){
+					int idx = (cy0 + 2 * (k / colorW)) * gridw + cx0 + 2 * (k % colorW);
+					unsigned int rngState = HashSeed(idx, stream, level, iter);
+					if (PropogateSeed<Stereo>(im1, im2, im1f, im2f, idx, seeds, grid, seedsFlow, bestCosts, radius[idx], vFlags, &rngState, evalCount, rejectCount)){
+						updateCount++;
+					}
 				}
 			}
-
-			// Random search: Improve current guess by searching in boxes
-			// of exponentially decreasing size around the current best guess.
-			for (int mag = radius[idx] + 0.5; mag >= 1; mag /= 2) {
-				/* Sampling window */
-				float tu = seedsFlow->pData[2 * idx] + rand() % (2 * mag + 1) - mag;
-
-				float tv = 0;
-				if (!_isStereo){
-					tv = seedsFlow->pData[2 * idx + 1] + rand() % (2 * mag + 1) - mag;
-				}
-
-				float cu = seedsFlow->pData[2 * idx];
-				float cv = seedsFlow->pData[2 * idx + 1];
-				if (abs(tu - cu) < 1e-6 && abs(tv - cv) < 1e-6){
-					continue;
-				}
-
-				float tc = MatchCost(im1, im2, im1f, im2f, x, y, x + tu, y + tv);
-				if (tc < bestCosts[idx]){
-					bestCosts[idx] = tc;
-					seedsFlow->pData[2 * idx] = tu;
-					seedsFlow->pData[2 * idx + 1] = tv;
-					updateFlag = true;
+			ws._costEvalCount += evalCount;
+			ws._earlyRejectCount += rejectCount;
+		}else{
+			for (int k = 0; k < ptNum; k++){
+				int pos = (iter % 2 == 1) ? ptNum - 1 - k : k;
+				int idx = (gy0 + pos / rectW) * gridw + gx0 + pos % rectW;
+				unsigned int rngState = HashSeed(idx, stream, level, iter);
+				if (PropogateSeed<Stereo>(im1, im2, im1f, im2f, idx, seeds, grid, seedsFlow, bestCosts, radius[idx], vFlags, &rngState, ws._costEvalCount, ws._earlyRejectCount)){
+					updateCount++;
 				}
 			}
-			vFlags[idx] = 1;
-            //ShowSuperPixelFlow(spt, img1, bestU, bestV, ptNum);
-
-			if (updateFlag){
-				updateCount++;
-			}
 		}
 		//printf("iter %d: %f [s]\n", iter, t.toc());
 
+		ws._iterUpdates[stream][iter] += updateCount;
+		ws._iterSeeds[stream][iter] += ptNum;
 		float updateRatio = float(updateCount) / ptNum;
 		//printf("Update ratio: %f\n", updateRatio);
 		if (updateRatio < _stopIterRatio || lastUpdateRatio - updateRatio < 0.01){
@@ -481,50 +1652,60 @@ int CPM::Propogate(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* pyd1f, UCI
 		}
 		lastUpdateRatio = updateRatio;
 	}
-
-	delete[] vFlags;
+	ws._streamEvalCount[stream] += ws._costEvalCount - evalStart;
+	ws._streamRejectCount[stream] += ws._earlyRejectCount - rejectStart;
 
 	return iter;
 }
 
 
 
-void CPM::PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage* pydSeeds, IntImage* pydSeeds2, IntImage& neighbors, IntImage& neighbors2, FImage* pydSeedsFlow, FImage* pydSeedsFlow2)
+void CPM::PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage* pydSeeds, const CPMSeedGrid& grid, FImage* pydSeedsFlow, FImage* pydSeedsFlow2, CPMWorkspace& ws) const
 {
     int nLevels = pyd1.nlevels();
     float ratio = pyd1.ratio();
 
-    FImage rawImg1 = pyd1[0];
-    FImage rawImg2 = pyd2[0];
-    srand(0);
+    FImageView rawImg1(pyd1[0]);
+    FImageView rawImg2(pyd2[0]);
 
     int w = rawImg1.width();
     int h = rawImg1.height();
-    int numV = pydSeeds[0].height();
-
-    float* bestCosts = new float[numV];
-    float* searchRadius = new float[numV];
-    float* bestCosts2 = new float[numV];
-    float* searchRadius2 = new float[numV];
+    int numV = grid.numV;
+
+    if (!ws._bestCosts.matchDimension(numV, 1, 1)){
+        ws._bestCosts.allocate(numV, 1);
+        ws._bestCosts2.allocate(numV, 1);
+        ws._searchRadius.allocate(numV, 1);
+        ws._searchRadius2.allocate(numV, 1);
+        ws._validFlag.allocate(numV, 1);
+        ws._validFlag2.allocate(numV, 1);
+        ws._vFlags.allocate(numV, 1);
+    }
+    float* bestCosts = ws._bestCosts.pData;
+    float* searchRadius = ws._searchRadius.pData;
+    float* bestCosts2 = ws._bestCosts2.pData;
+    float* searchRadius2 = ws._searchRadius2.pData;
 
     // random Initialization on coarsest level
     int initR = _maxDisplacement * pow(ratio, nLevels - 1) + 0.5;
     //int initR = 400 * pow(ratio, nLevels - 1) + 0.5;
     //printf("initR is %d\n", initR);
     for (int i = 0; i < numV; i++) {
-        pydSeedsFlow[nLevels - 1][2 * i] = rand() % (2 * initR + 1) - initR;
+        unsigned int rngState = HashSeed(i, 0, nLevels, 0);
+        pydSeedsFlow[nLevels - 1].rowPtr(0)[i] = NextRandom(&rngState) % (2 * initR + 1) - initR;
         if (_isStereo){
-            pydSeedsFlow[nLevels - 1][2 * i + 1] = 0;
+            pydSeedsFlow[nLevels - 1].rowPtr(1)[i] = 0;
         }else{
-            pydSeedsFlow[nLevels - 1][2 * i + 1] = rand() % (2 * initR + 1) - initR;
+            pydSeedsFlow[nLevels - 1].rowPtr(1)[i] = NextRandom(&rngState) % (2 * initR + 1) - initR;
         }
     }
     for (int i = 0; i < numV; i++) {
-        pydSeedsFlow2[nLevels - 1][2 * i] = rand() % (2 * initR + 1) - initR;
+        unsigned int rngState = HashSeed(i, 1, nLevels, 0);
+        pydSeedsFlow2[nLevels - 1].rowPtr(0)[i] = NextRandom(&rngState) % (2 * initR + 1) - initR;
         if (_isStereo){
-            pydSeedsFlow2[nLevels - 1][2 * i + 1] = 0;
+            pydSeedsFlow2[nLevels - 1].rowPtr(1)[i] = 0;
         }else{
-            pydSeedsFlow2[nLevels - 1][2 * i + 1] = rand() % (2 * initR + 1) - initR;
+            pydSeedsFlow2[nLevels - 1].rowPtr(1)[i] = NextRandom(&rngState) % (2 * initR + 1) - initR;
         }
     }
 
@@ -536,13 +1717,33 @@ void CPM::PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& p
         searchRadius2[i] = initR;
     }
 
-    int* iterCnts = new int[nLevels];
-    for (int i = 0; i < nLevels; i++){
-        iterCnts[i] = _maxIters;
+    // warm start: the seeds with a previous flow start from it, in a smaller radius
+    if (ws._warmStart){
+        float levelScale = pow(ratio, nLevels - 1);
+        int warmR = __max(1, int(_warmStartRadius * levelScale + 0.5));
+        for (int dir = 0; dir < 2; dir++){
+            FImage& warmFlow = (dir == 0) ? ws._warmFlow : ws._warmFlow2;
+            FImage& seedsFlow = (dir == 0) ? pydSeedsFlow[nLevels - 1] : pydSeedsFlow2[nLevels - 1];
+            float* warmU = warmFlow.rowPtr(0);
+            float* warmV = warmFlow.rowPtr(1);
+            float* flowU = seedsFlow.rowPtr(0);
+            float* flowV = seedsFlow.rowPtr(1);
+            float* radius = (dir == 0) ? searchRadius : searchRadius2;
+            for (int i = 0; i < numV; i++){
+                if (warmU[i] >= UNKNOWN_FLOW){
+                    continue;
+                }
+                flowU[i] = floor(warmU[i] * levelScale + 0.5);
+                flowV[i] = _isStereo ? 0 : floor(warmV[i] * levelScale + 0.5);
+                radius[i] = __min(warmR, initR);
+            }
+        }
     }
-    int* iterCnts2 = new int[nLevels];
+
+    int iterCnts[32];
+    assert(nLevels <= 32);
     for (int i = 0; i < nLevels; i++){
-        iterCnts2[i] = _maxIters;
+        iterCnts[i] = _maxIters;
     }
 
 
@@ -552,8 +1753,11 @@ void CPM::PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& p
         //        printf("%dth level %dth seed's initial search radius is %f\n", l, i, searchRadius[i]);
         //    }
         //}
-        int iCnt = Propogate(pyd1, pyd2, im1f, im2f, l, searchRadius, iterCnts[l], pydSeeds, neighbors, pydSeedsFlow, bestCosts);
-        int iCnt2 = Propogate(pyd2, pyd1, im2f, im1f, l, searchRadius2, iterCnts2[l], pydSeeds2, neighbors2, pydSeedsFlow2, bestCosts2);
+        int iCnt2;
+        int iCnt = Propogate(pyd1, pyd2, im1f, im2f, l, searchRadius, iterCnts[l], pydSeeds, grid, pydSeedsFlow, bestCosts, searchRadius2, pydSeedsFlow2, bestCosts2, &iCnt2, ws);
+
+        CPMLevelStats& st = ws._stats.levels[l];
+        CTimer t;
 
         //check cost and consistency here for coarsest level and finest level
         //if (l == 0) {
@@ -561,7 +1765,7 @@ void CPM::PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& p
         if (l == nLevels - 1 || l == 0) {
             // cross check & cost check
             //printf("bpmark!");
-            int* validFlag = new int[numV];
+            int* validFlag = ws._validFlag.pData;
             for (int i = 0; i < numV; i++){
                  validFlag[i] = 1;
             }
@@ -569,23 +1773,43 @@ void CPM::PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& p
             //WriteCosts("bestCosts_forward.txt", bestCosts, numV);
             //WriteCosts("bestCosts_backward.txt", bestCosts2, numV);
 
-            CrossCheck(pydSeeds[l], pydSeedsFlow[l], pydSeedsFlow2[l], _kLabels2, validFlag, _checkThreshold);
-            CostCheck(_seeds, bestCosts, bestCosts2, _kLabels2, validFlag, _costCheckThreshold);
+            CrossCheck(grid, pydSeeds[l], pydSeedsFlow[l], pydSeedsFlow2[l], ws._kLabels2, validFlag, _checkThreshold);
+            st.crossCheckRejects[0] = CountInvalid(validFlag, numV);
+            CostCheck(numV, bestCosts, bestCosts2, ws._kLabels2, validFlag, _costCheckThreshold / ws._costScale);
+            st.costCheckRejects[0] = CountInvalid(validFlag, numV) - st.crossCheckRejects[0];
+            st.crossCheckRejects[1] = st.crossCheckRejects[0];
+            st.costCheckRejects[1] = st.costCheckRejects[0];
+
+            // on the finest level the backward flow is checked against the forward one,
+            // so that it can be returned as a match set of its own
+            int* validFlag2 = validFlag;
+            if (l == 0){
+                validFlag2 = ws._validFlag2.pData;
+                CrossCheck(grid, pydSeeds[l], pydSeedsFlow2[l], pydSeedsFlow[l], ws._kLabels, validFlag2, _checkThreshold);
+                st.crossCheckRejects[1] = CountInvalid(validFlag2, numV);
+                CostCheck(numV, bestCosts2, bestCosts, ws._kLabels, validFlag2, _costCheckThreshold / ws._costScale);
+                st.costCheckRejects[1] = CountInvalid(validFlag2, numV) - st.crossCheckRejects[1];
+            }
 
-            FImage seedsFlow(2, numV), seedsFlow2(2, numV);
+            FImage& seedsFlow = ws._seedsFlow;
+            FImage& seedsFlow2 = ws._seedsFlow2;
             seedsFlow.copyData(pydSeedsFlow[l]);
             seedsFlow2.copyData(pydSeedsFlow2[l]);
+            float* flowU = seedsFlow.rowPtr(0);
+            float* flowV = seedsFlow.rowPtr(1);
+            float* flowU2 = seedsFlow2.rowPtr(0);
+            float* flowV2 = seedsFlow2.rowPtr(1);
             for (int i = 0; i < numV; i++){
                 if (!validFlag[i]){
-                    seedsFlow[2 * i] = UNKNOWN_FLOW;
-                    seedsFlow[2 * i + 1] = UNKNOWN_FLOW;
+                    flowU[i] = UNKNOWN_FLOW;
+                    flowV[i] = UNKNOWN_FLOW;
                 }
             }
 
             for (int i = 0; i < numV; i++){
-                if (!validFlag[i]){
-                    seedsFlow2[2 * i] = UNKNOWN_FLOW;
-                    seedsFlow2[2 * i + 1] = UNKNOWN_FLOW;
+                if (!validFlag2[i]){
+                    flowU2[i] = UNKNOWN_FLOW;
+                    flowV2[i] = UNKNOWN_FLOW;
                 }
             }
 
@@ -593,23 +1817,26 @@ void CPM::PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& p
 
             // if outliers are in coarsest level, reinitilize them
             if(l == nLevels - 1) {
+                st.reinitializations = CountInvalid(validFlag, numV);
                 // random Initialization on coarsest level
                 int initR = _maxDisplacement * pow(ratio, nLevels - 1) + 0.5;
                 //int initR = 400 * pow(ratio, nLevels - 1) + 0.5;
                 //printf("initR is %d\n", initR);
                 for (int i = 0; i < numV; i++) {
                     if (!validFlag[i]) {
-                        seedsFlow[2 * i] = rand() % (2 * initR + 1) - initR;
+                        unsigned int rngState = HashSeed(i, 0, nLevels, 1);
+                        flowU[i] = NextRandom(&rngState) % (2 * initR + 1) - initR;
                         if (_isStereo){
-                            seedsFlow[2 * i + 1] = 0;
+                            flowV[i] = 0;
                         }else{
-                            seedsFlow[2 * i + 1] = rand() % (2 * initR + 1) - initR;
+                            flowV[i] = NextRandom(&rngState) % (2 * initR + 1) - initR;
                         }
-                        seedsFlow2[2 * i] = rand() % (2 * initR + 1) - initR;
+                        unsigned int rngState2 = HashSeed(i, 1, nLevels, 1);
+                        flowU2[i] = NextRandom(&rngState2) % (2 * initR + 1) - initR;
                         if (_isStereo){
-                            seedsFlow2[2 * i + 1] = 0;
+                            flowV2[i] = 0;
                         }else{
-                            seedsFlow2[2 * i + 1] = rand() % (2 * initR + 1) - initR;
+                            flowV2[i] = NextRandom(&rngState2) % (2 * initR + 1) - initR;
                         }
                     }
                 }
@@ -618,13 +1845,12 @@ void CPM::PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& p
 
             pydSeedsFlow[l].copyData(seedsFlow);
             pydSeedsFlow2[l].copyData(seedsFlow2);
-
-            delete[] validFlag;
         }
+        st.checkTime = t.toc();
 
         if (l > 0){
-            UpdateSearchRadius(neighbors, pydSeedsFlow, l, searchRadius);
-            UpdateSearchRadius(neighbors2, pydSeedsFlow2, l, searchRadius2);
+            UpdateSearchRadius(grid, pydSeedsFlow, l, searchRadius);
+            UpdateSearchRadius(grid, pydSeedsFlow2, l, searchRadius2);
             // scale the radius accordingly
             int maxR = __min(32, _maxDisplacement * pow(ratio, l) + 0.5); // CPM official origin
             //int maxR = __min(11, _maxDisplacement * pow(ratio, l) + 0.5); // CPM modify in tip2017 #tipModification
@@ -661,45 +1887,45 @@ void CPM::PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& p
             pydSeedsFlow[l - 1].Multiplywith(1. / ratio);
             pydSeedsFlow2[l - 1].copyData(pydSeedsFlow2[l]);
             pydSeedsFlow2[l - 1].Multiplywith(1. / ratio);
+            st.radiusTime = t.toc();
         }
     }
 
-    delete[] searchRadius;
-    delete[] bestCosts;
-    delete[] iterCnts;
-    delete[] searchRadius2;
-    delete[] bestCosts2;
-    delete[] iterCnts2;
 }
 
 
 
-void CPM::PyramidRandomSearch(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage* pydSeeds, IntImage& neighbors, FImage* pydSeedsFlow)
+void CPM::PyramidRandomSearch(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage* pydSeeds, const CPMSeedGrid& grid, FImage* pydSeedsFlow, CPMWorkspace& ws) const
 {
 	int nLevels = pyd1.nlevels();
 	float ratio = pyd1.ratio();
 
-	FImage rawImg1 = pyd1[0];
-	FImage rawImg2 = pyd2[0];
-	srand(0);
+	FImageView rawImg1(pyd1[0]);
+	FImageView rawImg2(pyd2[0]);
 
 	int w = rawImg1.width();
 	int h = rawImg1.height();
-	int numV = pydSeeds[0].height();
+	int numV = grid.numV;
 
-	float* bestCosts = new float[numV];
-	float* searchRadius = new float[numV];
+	if (!ws._bestCosts.matchDimension(numV, 1, 1)){
+		ws._bestCosts.allocate(numV, 1);
+		ws._searchRadius.allocate(numV, 1);
+		ws._vFlags.allocate(numV, 1);
+	}
+	float* bestCosts = ws._bestCosts.pData;
+	float* searchRadius = ws._searchRadius.pData;
 
 	// random Initialization on coarsest level
     int initR = _maxDisplacement * pow(ratio, nLevels - 1) + 0.5;
     //int initR = 400 * pow(ratio, nLevels - 1) + 0.5;
     //printf("initR is %d\n", initR);
 	for (int i = 0; i < numV; i++){
-		pydSeedsFlow[nLevels - 1][2 * i] = rand() % (2 * initR + 1) - initR;
+		unsigned int rngState = HashSeed(i, 0, nLevels, 0);
+		pydSeedsFlow[nLevels - 1].rowPtr(0)[i] = NextRandom(&rngState) % (2 * initR + 1) - initR;
 		if (_isStereo){
-			pydSeedsFlow[nLevels - 1][2 * i + 1] = 0;
+			pydSeedsFlow[nLevels - 1].rowPtr(1)[i] = 0;
 		}else{
-			pydSeedsFlow[nLevels - 1][2 * i + 1] = rand() % (2 * initR + 1) - initR;
+			pydSeedsFlow[nLevels - 1].rowPtr(1)[i] = NextRandom(&rngState) % (2 * initR + 1) - initR;
 		}
 	}
 
@@ -708,16 +1934,17 @@ void CPM::PyramidRandomSearch(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage*
 		searchRadius[i] = initR;
 	}
 
-	int* iterCnts = new int[nLevels];
+	int iterCnts[32];
+	assert(nLevels <= 32);
 	for (int i = 0; i < nLevels; i++){
 		iterCnts[i] = _maxIters;
 	}
 
 	for (int l = nLevels - 1; l >= 0; l--){ // coarse-to-fine
-		int iCnt = Propogate(pyd1, pyd2, im1f, im2f, l, searchRadius, iterCnts[l], pydSeeds, neighbors, pydSeedsFlow, bestCosts);
+		int iCnt = Propogate(pyd1, pyd2, im1f, im2f, l, searchRadius, iterCnts[l], pydSeeds, grid, pydSeedsFlow, bestCosts, NULL, NULL, NULL, NULL, ws);
 
 		if (l > 0){
-			UpdateSearchRadius(neighbors, pydSeedsFlow, l, searchRadius);
+			UpdateSearchRadius(grid, pydSeedsFlow, l, searchRadius);
 
 			// scale the radius accordingly
             int maxR = __min(32, _maxDisplacement * pow(ratio, l) + 0.5); // CPM official origin
@@ -733,42 +1960,43 @@ void CPM::PyramidRandomSearch(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage*
 		}
 	}
 
-	delete[] searchRadius;
-	delete[] bestCosts;
-	delete[] iterCnts;
 }
 
 
 
 //#tipModification
 //forward and backward passes and consistency check
-void CPM::TwoPassesAndTwoChecks(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage& seeds, IntImage& seeds2, IntImage& neighbors, IntImage& neighbors2, FImage* pydSeedsFlow, FImage* pydSeedsFlow2)
+void CPM::TwoPassesAndTwoChecks(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, FImage* pydSeedsFlow, FImage* pydSeedsFlow2, CPMWorkspace& ws) const
 {
-    FImage rawImg1 = pyd1[0];
-    FImage rawImg2 = pyd2[0];
+    FImageView rawImg1(pyd1[0]);
+    FImageView rawImg2(pyd2[0]);
 
     int nLevels = pyd1.nlevels();
     float ratio = pyd1.ratio();
 
-    int numV = seeds.height();
+    CPMSeedGrid& grid = ws._grid;
+    int numV = grid.numV;
 
-    IntImage* pydSeeds = new IntImage[nLevels];
-    IntImage* pydSeeds2 = new IntImage[nLevels];
-    for (int i = 0; i < nLevels; i++){
-        pydSeeds[i].allocate(2, numV);
-        pydSeeds2[i].allocate(2, numV);
+    // both directions use the same seed positions
+    IntImage* pydSeeds = ws._pydSeeds;
+    const int* seedsX = pydSeeds[0].rowPtr(0);
+    const int* seedsY = pydSeeds[0].rowPtr(1);
+    for (int i = 1; i < nLevels; i++){
+        if (!pydSeeds[i].matchDimension(grid.stride, 2, 1)){
+            pydSeeds[i].allocate(grid.stride, 2);
+        }
         int sw = pyd1[i].width();
         int sh = pyd1[i].height();
+        int* levelX = pydSeeds[i].rowPtr(0);
+        int* levelY = pydSeeds[i].rowPtr(1);
         for (int n = 0; n < numV; n++){
-            pydSeeds[i][2 * n] = ImageProcessing::EnforceRange(seeds[2 * n] * pow(ratio, i), sw);
-            pydSeeds[i][2 * n + 1] = ImageProcessing::EnforceRange(seeds[2 * n + 1] * pow(ratio, i), sh);
-            pydSeeds2[i][2 * n] = ImageProcessing::EnforceRange(seeds2[2 * n] * pow(ratio, i), sw);
-            pydSeeds2[i][2 * n + 1] = ImageProcessing::EnforceRange(seeds2[2 * n + 1] * pow(ratio, i), sh);
+            levelX[n] = ImageProcessing::EnforceRange(seedsX[n] * pow(ratio, i), sw);
+            levelY[n] = ImageProcessing::EnforceRange(seedsY[n] * pow(ratio, i), sh);
         }
     }
 
-    //PyramidRandomSearch(pyd1, pyd2, im1f, im2f, pydSeeds, neighbors, pydSeedsFlow);
-    PyramidRandomSearchWithTwoChecks(pyd1, pyd2, im1f, im2f, pydSeeds, pydSeeds2, neighbors, neighbors2, pydSeedsFlow, pydSeedsFlow2);
+    //PyramidRandomSearch(pyd1, pyd2, im1f, im2f, pydSeeds, grid, pydSeedsFlow, ws);
+    PyramidRandomSearchWithTwoChecks(pyd1, pyd2, im1f, im2f, pydSeeds, grid, pydSeedsFlow, pydSeedsFlow2, ws);
 
     // scale
     int b = _borderWidth;
@@ -776,67 +2004,128 @@ void CPM::TwoPassesAndTwoChecks(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImag
         pydSeedsFlow[i].Multiplywith(pow(1. / ratio, i));
         pydSeedsFlow2[i].Multiplywith(pow(1. / ratio, i));
     }
-
-    delete[] pydSeeds;
 }
 
 
-void CPM::OnePass(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage& seeds, IntImage& neighbors, FImage* pydSeedsFlow)
+void CPM::OnePass(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, FImage* pydSeedsFlow, CPMWorkspace& ws) const
 {
-	FImage rawImg1 = pyd1[0];
-	FImage rawImg2 = pyd2[0];
+	FImageView rawImg1(pyd1[0]);
+	FImageView rawImg2(pyd2[0]);
 
 	int nLevels = pyd1.nlevels();
 	float ratio = pyd1.ratio();
 
-	int numV = seeds.height();
+	CPMSeedGrid& grid = ws._grid;
+	int numV = grid.numV;
 
-	IntImage* pydSeeds = new IntImage[nLevels];
-	for (int i = 0; i < nLevels; i++){
-		pydSeeds[i].allocate(2, numV);
+	IntImage* pydSeeds = ws._pydSeeds;
+	const int* seedsX = pydSeeds[0].rowPtr(0);
+	const int* seedsY = pydSeeds[0].rowPtr(1);
+	for (int i = 1; i < nLevels; i++){
+		if (!pydSeeds[i].matchDimension(grid.stride, 2, 1))
+			pydSeeds[i].allocate(grid.stride, 2);
 		int sw = pyd1[i].width();
 		int sh = pyd1[i].height();
+		int* levelX = pydSeeds[i].rowPtr(0);
+		int* levelY = pydSeeds[i].rowPtr(1);
 		for (int n = 0; n < numV; n++){
-			pydSeeds[i][2 * n] = ImageProcessing::EnforceRange(seeds[2 * n] * pow(ratio, i), sw);
-			pydSeeds[i][2 * n + 1] = ImageProcessing::EnforceRange(seeds[2 * n + 1] * pow(ratio, i), sh);
+			levelX[n] = ImageProcessing::EnforceRange(seedsX[n] * pow(ratio, i), sw);
+			levelY[n] = ImageProcessing::EnforceRange(seedsY[n] * pow(ratio, i), sh);
 		}
 	}
 
-	PyramidRandomSearch(pyd1, pyd2, im1f, im2f, pydSeeds, neighbors, pydSeedsFlow);
+	PyramidRandomSearch(pyd1, pyd2, im1f, im2f, pydSeeds, grid, pydSeedsFlow, ws);
 
 	// scale
 	int b = _borderWidth;
 	for (int i = 0; i < nLevels; i++){
 		pydSeedsFlow[i].Multiplywith(pow(1. / ratio, i));
 	}
+}
 
-	delete[] pydSeeds;
+
+void CPM::UpdateSearchRadius(const CPMSeedGrid& grid, FImage* pydSeedsFlow, int level, float* outRadius) const
+{
+	if (_isStereo)
+		UpdateSearchRadiusT<true>(grid, pydSeedsFlow, level, outRadius);
+	else
+		UpdateSearchRadiusT<false>(grid, pydSeedsFlow, level, outRadius);
 }
 
+// range of the horizontal flow over seed idx and its neighbors
+static inline float FlowRange(const CPMSeedGrid& grid, const float* u, int idx)
+{
+	int gridX = idx % grid.gridw;
+	int gridY = idx / grid.gridw;
+	float minU = u[idx];
+	float maxU = minU;
+	for (int k = 0; k < 8; k++){
+		int nb = grid.Neighbor(idx, gridX, gridY, k);
+		if (nb < 0){
+			continue;
+		}
+		minU = __min(minU, u[nb]);
+		maxU = __max(maxU, u[nb]);
+	}
+	return maxU - minU;
+}
 
-void CPM::UpdateSearchRadius(IntImage& neighbors, FImage* pydSeedsFlow, int level, float* outRadius)
+template <bool Stereo>
+void CPM::UpdateSearchRadiusT(const CPMSeedGrid& grid, FImage* pydSeedsFlow, int level, float* outRadius) const
 {
 	FImage* seedsFlow = pydSeedsFlow + level;
-	int maxNb = neighbors.width();
-
-	float x[32], y[32]; // for minimal circle
-	assert(maxNb < 32);
+	const float* flowU = seedsFlow->rowPtr(0);
+	const float* flowV = seedsFlow->rowPtr(1);
+	int gridw = grid.gridw;
+	int gridh = grid.gridh;
+
+	if (Stereo){
+		// the flows are on a line: the minimal circle is half of their range.
+		// The inner seeds of a row read the 3 rows around it at fixed offsets
+		for (int gy = 0; gy < gridh; gy++){
+			float* out = outRadius + gy*gridw;
+			if (gy == 0 || gy == gridh - 1 || gridw < 3){
+				for (int gx = 0; gx < gridw; gx++){
+					out[gx] = FlowRange(grid, flowU, gy*gridw + gx) / 2;
+				}
+				continue;
+			}
+			const float* r0 = flowU + (gy - 1)*gridw;
+			const float* r1 = r0 + gridw;
+			const float* r2 = r1 + gridw;
+			out[0] = FlowRange(grid, flowU, gy*gridw) / 2;
+			for (int gx = 1; gx < gridw - 1; gx++){
+				float minU = __min(__min(r0[gx - 1], r0[gx]), r0[gx + 1]);
+				minU = __min(minU, __min(__min(r1[gx - 1], r1[gx]), r1[gx + 1]));
+				minU = __min(minU, __min(__min(r2[gx - 1], r2[gx]), r2[gx + 1]));
+				float maxU = __max(__max(r0[gx - 1], r0[gx]), r0[gx + 1]);
+				maxU = __max(maxU, __max(__max(r1[gx - 1], r1[gx]), r1[gx + 1]));
+				maxU = __max(maxU, __max(__max(r2[gx - 1], r2[gx]), r2[gx + 1]));
+				out[gx] = (maxU - minU) / 2;
+			}
+			out[gridw - 1] = FlowRange(grid, flowU, gy*gridw + gridw - 1) / 2;
+		}
+		return;
+	}
 
-	int sCnt = seedsFlow->height();
-	for (int i = 0; i < sCnt; i++){
+	float x[9], y[9]; // for minimal circle
+	for (int i = 0; i < grid.numV; i++){
 		// add itself
-		x[0] = seedsFlow->pData[2 * i];
-		y[0] = seedsFlow->pData[2 * i + 1];
+		x[0] = flowU[i];
+		y[0] = flowV[i];
 		int nbCnt = 1;
 
 		// add neighbors
-		int* nbIdx = neighbors.rowPtr(i);
-		for (int n = 0; n < maxNb; n++){
-			if (nbIdx[n] < 0){
-				break;
+		int gridX = i % gridw;
+		int gridY = i / gridw;
+		bool inner = grid.IsInner(gridX, gridY);
+		for (int k = 0; k < 8; k++){
+			int nb = inner ? i + grid.nbDelta[k] : grid.Neighbor(i, gridX, gridY, k);
+			if (nb < 0){
+				continue;
 			}
-			x[nbCnt] = seedsFlow->pData[2 * nbIdx[n]];
-			y[nbCnt] = seedsFlow->pData[2 * nbIdx[n] + 1];
+			x[nbCnt] = flowU[nb];
+			y[nbCnt] = flowV[nb];
             nbCnt++;
         }
         float circleR = MinimalCircle(x, y, nbCnt);
@@ -931,7 +2220,7 @@ float CPM::MinimalCircle(float* x, float*y, int n, float* centerX, float* center
 	return r;
 }
 
-void CPM::WriteCosts(const char *filename, float* inMat, int numV)
+void CPM::WriteCosts(const char *filename, float* inMat, int numV) const
 {
     int len = numV;
     FILE *fid = fopen(filename, "w");
@@ -945,3 +2234,58 @@ void CPM::WriteCosts(const char *filename, float* inMat, int numV)
     }
     fclose(fid);
 }
+
+CPMStream::CPMStream(const CPM& cpm) : _cpm(cpm)
+{
+	_frameCount = 0;
+	_warmStart = 0;
+}
+
+void CPMStream::SetWarmStart(int warmStart)
+{
+	_warmStart = warmStart;
+}
+
+void CPMStream::Reset()
+{
+	_frameCount = 0;
+	_prevMatches.clear();
+}
+
+bool CPMStream::MatchNewest(FImage& frame)
+{
+	CPMFeatures& feats = _feats[_frameCount % 2];
+	_cpm.ExtractFeatures(frame, feats);
+	_frameCount++;
+	if (_frameCount < 2){
+		return false;
+	}
+
+	CPMFeatures& prevFeats = _feats[_frameCount % 2];
+	FImage* prevMatches = (_warmStart && _prevMatches.height() > 0) ? &_prevMatches : NULL;
+	_cpm.MatchSeeds(prevFeats, feats, _ws, prevMatches);
+	if (_warmStart){
+		_cpm.SeedsFlowToMatches(_ws._grid, _ws._pydSeeds[0], _ws._pydSeedsFlow[0], _prevMatches, _ws);
+	}
+	return true;
+}
+
+bool CPMStream::Push(FImage& frame, cv::Mat2f& outFwdFlow, cv::Mat2f& outBwdFlow)
+{
+	if (!MatchNewest(frame)){
+		return false;
+	}
+	_cpm.SeedsFlowToDense(_ws._grid, _ws._pydSeeds[0], _ws._pydSeedsFlow2[0], outBwdFlow);
+	_cpm.SeedsFlowToDense(_ws._grid, _ws._pydSeeds[0], _ws._pydSeedsFlow[0], outFwdFlow);
+	return true;
+}
+
+bool CPMStream::Push(FImage& frame, FImage& outFwdMatches, FImage& outBwdMatches)
+{
+	if (!MatchNewest(frame)){
+		return false;
+	}
+	_cpm.SeedsFlowToMatches(_ws._grid, _ws._pydSeeds[0], _ws._pydSeedsFlow2[0], outBwdMatches, _ws);
+	_cpm.SeedsFlowToMatches(_ws._grid, _ws._pydSeeds[0], _ws._pydSeedsFlow[0], outFwdMatches, _ws);
+	return true;
+}
@@ -27,40 +27,387 @@ corresponding to one match per line.
 #define _CPM_H_
 
 #include "include/ImagePyramid.h"
+#include <vector>
 
+// Image pyramid of one frame and the DAISY features of every level.
+// Built once by CPM::ExtractFeatures, it can be used for all the pairs the frame
+// appears in, in both directions. It is only read by Matching, so several
+// threads can match against the same features.
+// With a tile memory budget (CPM::SetTileMemory) the fine levels that do not fit are
+// left without features, they are computed tile by tile during the matching.
+// With a region of interest (CPM::SetROI) the pyramid only covers the part of the
+// frame the ROI can be matched with, width() and height() are then the ones of that part.
+class CPMFeatures
+{
+public:
+	CPMFeatures();
+	~CPMFeatures();
+
+	inline int nlevels() const { return _nLevels; };
+	inline int width() const { return _nLevels > 0 ? _pyd[0].width() : 0; };
+	inline int height() const { return _nLevels > 0 ? _pyd[0].height() : 0; };
+
+private:
+	friend class CPM;
+
+	// not copyable, the per-level features are owned
+	CPMFeatures(const CPMFeatures&);
+	CPMFeatures& operator=(const CPMFeatures&);
+
+	void AllocateLevels(int nLevels);
+	void ReleaseLevels();
+
+	int _nLevels;
+	FImagePyramid _pyd;
+	UCImage* _ftImgs;
+	float _costScale; // brings the matching costs to the scale of the full DAISY ones
+	int _ox, _oy;     // position of the pyramid in the frame (ROI mode)
+
+	// time [s] spent on each level of the pyramid and on its features
+	std::vector<double> _pydTimes, _ftTimes;
+};
+
+// Timings [s] and counters of one pyramid level of a matching. Index 0 of the
+// per-direction arrays is the forward direction (image 1 -> image 2), 1 the backward one.
+struct CPMLevelStats
+{
+	CPMLevelStats();
+
+	int width, height;
+	double pyramidTime;     // both frames
+	double featureTime;     // both frames, tiles of a tiled level included
+	double propagationTime; // both directions, without the tile features
+	double checkTime;       // cross and cost checks, reinitialization
+	double radiusTime;      // search radius update and upsampling to the next level
+	int iterations[2];
+	std::vector<float> updateRatios[2]; // of each iteration (over all the tiles)
+	long long matchCostCalls[2];        // initial costs and propagation candidates
+	long long earlyRejects[2];          // candidates stopped by the bound of the best cost
+	// seeds found invalid by CrossCheck and the additional ones by CostCheck; the
+	// coarsest level checks both directions with the same flags
+	int crossCheckRejects[2];
+	int costCheckRejects[2];
+	int reinitializations;              // coarsest level, both directions
+};
+
+// Where the time of one matching goes, level by level (0 is the finest). The pyramid
+// and feature times are the ones of the CPMFeatures matched, so features shared by
+// several pairs are counted in each of them.
+struct CPMStats
+{
+	CPMStats();
+	void Reset(int nLevels);
+
+	void WriteJSON(FILE* fp) const;
+	// an array with the stats of several matchings (e.g. the pairs of a sequence)
+	static bool SaveJSON(const char* filename, const CPMStats* stats, int count);
+
+	int numSeeds;
+	double matchTime; // whole matching, without the features
+	std::vector<CPMLevelStats> levels;
+};
+
+// Regular grid of seeds, seed i being at grid position (i % gridw, i / gridw).
+// The neighbors of a seed are its 8-connected grid positions, computed from the
+// grid coordinates instead of being stored. Per-seed values (x and y, u and v)
+// are kept as planes, one image row of stride elements per component; stride is
+// padded to 64 bytes so that every plane starts on a cache line.
+struct CPMSeedGrid
+{
+	CPMSeedGrid() : gridw(0), gridh(0), numV(0), stride(0){};
+
+	void Set(int w, int h){
+		gridw = w;
+		gridh = h;
+		numV = w * h;
+		stride = (numV + 15) / 16 * 16;
+		// grid offsets in the order the neighbors are visited
+		static const int offsets[8][2] = { { 0, -1 }, { 0, 1 }, { 1, 0 }, { -1, 0 }, { -1, -1 }, { -1, 1 }, { 1, -1 }, { 1, 1 } };
+		for (int k = 0; k < 8; k++){
+			nbDx[k] = offsets[k][0];
+			nbDy[k] = offsets[k][1];
+			nbDelta[k] = offsets[k][1] * w + offsets[k][0];
+		}
+	};
+	// seed away from the grid border: all its neighbors are idx + nbDelta[k]
+	inline bool IsInner(int gridX, int gridY) const {
+		return gridX > 0 && gridX < gridw - 1 && gridY > 0 && gridY < gridh - 1;
+	};
+	// k-th neighbor of seed idx at (gridX, gridY), -1 if it is out of the grid
+	inline int Neighbor(int idx, int gridX, int gridY, int k) const {
+		int nx = gridX + nbDx[k];
+		int ny = gridY + nbDy[k];
+		if (nx < 0 || nx >= gridw || ny < 0 || ny >= gridh)
+			return -1;
+		return idx + nbDelta[k];
+	};
+
+	int gridw, gridh;
+	int numV;
+	int stride;
+	int nbDx[8], nbDy[8], nbDelta[8];
+};
+
+// DAISY features of (a window of) one pyramid level. Positions are in level coordinates
+// and clamped to the level like in the whole image; a position out of the valid part
+// [x0, x1) x [y0, y1) of the window has no feature. ftImg starts at (ox, oy) of the level.
+struct CPMFeatureWindow
+{
+	CPMFeatureWindow(UCImage& ft) : ftImg(&ft), ox(0), oy(0), x0(0), y0(0), x1(ft.width()), y1(ft.height()), levelW(ft.width()), levelH(ft.height()){};
+	CPMFeatureWindow(UCImage& ft, int originX, int originY, int validX0, int validY0, int validX1, int validY1, int levelWidth, int levelHeight)
+		: ftImg(&ft), ox(originX), oy(originY), x0(validX0), y0(validY0), x1(validX1), y1(validY1), levelW(levelWidth), levelH(levelHeight){};
+
+	// NULL when (x, y) is out of the window
+	inline unsigned char* pixPtr(int x, int y) const {
+		x = ImageProcessing::EnforceRange(x, levelW);
+		y = ImageProcessing::EnforceRange(y, levelH);
+		if (x < x0 || x >= x1 || y < y0 || y >= y1)
+			return NULL;
+		return ftImg->pixPtr(y - oy, x - ox);
+	};
+	inline int nchannels() const { return ftImg->nchannels(); };
+
+	UCImage* ftImg;
+	int ox, oy;
+	int x0, y0, x1, y1;
+	int levelW, levelH;
+};
+
+// Buffers used by CPM::Matching: pyramids, features, seeds and seed flows.
+// They are kept between calls and only reallocated when the input size changes,
+// so a workspace can be reused for every pair processed by the same thread.
+// A workspace must not be shared by concurrent Matching calls.
+class CPMWorkspace
+{
+public:
+	CPMWorkspace();
+	~CPMWorkspace();
+
+	// candidates evaluated during the propagation of the last matching,
+	// and how many of them were rejected before the whole descriptor was read
+	inline long long CostEvalCount() const { return _costEvalCount; };
+	inline long long EarlyRejectCount() const { return _earlyRejectCount; };
+	// level by level timings and counters of the last matching
+	inline const CPMStats& Stats() const { return _stats; };
+
+private:
+	friend class CPM;
+	friend class CPMStream;
+
+	// not copyable, the per-level buffers are owned
+	CPMWorkspace(const CPMWorkspace&);
+	CPMWorkspace& operator=(const CPMWorkspace&);
+
+	void AllocateLevels(int nLevels);
+	void ReleaseLevels();
+
+	int _nLevels; // number of levels of the per-level buffers below
+
+	IntImage _kLabels, _kLabels2;
+
+	// features of the two images when Matching is called with images
+	CPMFeatures _feats1;
+	CPMFeatures _feats2;
+
+	CPMSeedGrid _grid;
+
+	// u and v planes of the seed flows of every level
+	FImage* _pydSeedsFlow;
+	FImage* _pydSeedsFlow2;
+
+	// x and y planes of the seed positions of every level, shared by both directions
+	// (level 0 is the full resolution grid)
+	IntImage* _pydSeeds;
+
+	// per-seed scratch buffers
+	FImage _bestCosts, _bestCosts2;
+	FImage _searchRadius, _searchRadius2;
+	IntImage _validFlag, _validFlag2;
+	IntImage _vFlags;
+
+	// tiled levels: crop of a level and the features of the two windows of a tile
+	FImage _tileImg;
+	UCImage _tileDaisy;
+	UCImage _tileFt1, _tileFt2;
+
+	// warm start: flow of each seed (full resolution, u and v planes) taken from the
+	// previous pair, UNKNOWN_FLOW where it has none
+	bool _warmStart;
+	FImage _warmFlow, _warmFlow2;
+	FImage _seedsFlow, _seedsFlow2;
+	FImage _tmpMatch;
+
+	long long _costEvalCount;
+	long long _earlyRejectCount;
+
+	CPMStats _stats;
+	// seeds updated and seeds visited at each iteration of the current propagation, and
+	// its candidates evaluated and rejected early, for each direction
+	std::vector<int> _iterUpdates[2], _iterSeeds[2];
+	long long _streamEvalCount[2], _streamRejectCount[2];
+
+	float _costScale; // of the features being matched
+};
+
+// CPM only holds the matching parameters. All the state of a matching is kept
+// in a CPMWorkspace, so one configured CPM can be shared by several threads as
+// long as each of them uses its own workspace.
 class CPM
 {
 public:
     CPM();
 	~CPM();
 
-	int Matching(FImage& img1, FImage& img2, FImage& outMatches);
+	// convenience version using a temporary workspace
+	int Matching(FImage& img1, FImage& img2, FImage& outMatches) const;
+	int Matching(FImage& img1, FImage& img2, FImage& outMatches, CPMWorkspace& ws) const;
+	// forward (img1 -> img2) and backward (img2 -> img1) matches of one run,
+	// each of them cross-checked against the other; returns the number of forward matches
+	int MatchingBidirectional(FImage& img1, FImage& img2, FImage& outFwdMatches, FImage& outBwdMatches) const;
+	int MatchingBidirectional(FImage& img1, FImage& img2, FImage& outFwdMatches, FImage& outBwdMatches, CPMWorkspace& ws) const;
+
+	// same as above with features extracted beforehand (and possibly shared by several pairs)
+	void ExtractFeatures(FImage& img, CPMFeatures& outFeats) const;
+	// prevMatches (optional) are the matches of the previous pair of a sequence (frame i-1 -> i
+	// when matching i -> i+1): the coarsest level then starts from their flow instead of a
+	// random one, in a search radius reduced to the warm start radius
+	int Matching(CPMFeatures& feats1, CPMFeatures& feats2, FImage& outMatches, CPMWorkspace& ws, FImage* prevMatches = NULL) const;
+	int MatchingBidirectional(CPMFeatures& feats1, CPMFeatures& feats2, FImage& outFwdMatches, FImage& outBwdMatches, CPMWorkspace& ws, FImage* prevMatches = NULL) const;
+
+	// dense output without the match list: the flow (or horizontal disparity) of every valid
+	// seed is written to the 3x3 pixels around it, the other pixels are left untouched, so
+	// the buffers are allocated (and initialized, e.g. to unknown) by the caller.
+	// Returns the number of valid forward seeds
+	int MatchingToFlow(FImage& img1, FImage& img2, cv::Mat2f& outFlow) const;
+	int MatchingToFlow(CPMFeatures& feats1, CPMFeatures& feats2, cv::Mat2f& outFwdFlow, cv::Mat2f& outBwdFlow, CPMWorkspace& ws) const;
+	int MatchingToDisp(FImage& img1, FImage& img2, cv::Mat1f& outDisp) const;
+	int MatchingToDisp(CPMFeatures& feats1, CPMFeatures& feats2, cv::Mat1f& outFwdDisp, cv::Mat1f& outBwdDisp, CPMWorkspace& ws) const;
+
+	// views of a light-field row or column (equally spaced, stereo flag set): the center view
+	// is matched against every other view. The pair center -> center + k starts from the
+	// matches of its neighbour pair center -> center + k - 1 (toward the center) scaled by
+	// k / (k - 1), in the warm start radius, so only the two pairs next to the center start
+	// from a random init. The features of every view are extracted once, by the caller.
+	// outMatches[v] (optional) receives the center -> v matches, outStats[v] (optional) the
+	// stats of that pair; nothing is written for the center. Returns the number of matches.
+	// The views on the right and the ones on the left are two independent chains: with
+	// wsLeft the left one is matched on it, on a second thread, the right one on ws
+	int MatchingMultiView(CPMFeatures* feats, int nViews, int center, FImage* outMatches, CPMWorkspace& ws, CPMStats* outStats = NULL, CPMWorkspace* wsLeft = NULL) const;
+	// same, written as the disparity of every view for one view step (v -> v + 1): the
+	// v -> center disparity divided by center - v, and for the center the one of its first
+	// pair. Dense buffers as for MatchingToDisp
+	int MatchingMultiViewToDisp(CPMFeatures* feats, int nViews, int center, cv::Mat1f* outDisp, CPMWorkspace& ws, CPMStats* outStats = NULL, CPMWorkspace* wsLeft = NULL) const;
 	void SetStereoFlag(int needStereo);
 	void SetStep(int step);
 	void SetMaxDisplacement(int maxDisplacement);
 	void SetCheckThreshold(float checkThreshold);
 	void SetCostCheckThreshold(float costCheckThreshold);
+	// propagate the seeds of one level on all threads (red-black like schedule on the
+	// 2x2 colored seed grid), for single pairs; off by default (sequential scan)
+	void SetParallelPropagation(int parallel);
+	// warm start (see prevMatches above): search radius around the previous flow in pixels of
+	// the full resolution, and whether that flow is moved along itself (constant motion)
+	// instead of being used at the same positions
+	void SetWarmStartRadius(int radius);
+	void SetWarmStartWarp(int warp);
+	// bounded memory for very large frames: the levels whose features (of both images)
+	// do not fit in megabytes are matched in tiles of seeds, with the features of each
+	// tile computed when it is matched and discarded after; 0 (default) keeps all levels.
+	// Each tile runs its own propagation iterations, after the tiles before it, so the
+	// matches can differ a little from the untiled ones, and more the smaller the budget.
+	void SetTileMemory(int megabytes);
+	// region of interest (x, y, width, height in frame coordinates): only the seeds inside
+	// it are returned, the features and the propagation are limited to it widened by the
+	// max displacement, so the cost scales with the ROI area. The features must be
+	// extracted with the same ROI. w or h <= 0 (default) matches the whole frame
+	void SetROI(int x, int y, int w, int h);
+	// pyramid built by cascading the 5-tap binomial blur-and-decimate (fast) instead of
+	// blurring the full resolution image with the sigma of each level (default, the
+	// original behavior); only used with the default ratio of 0.5
+	void SetBinomialPyramid(int binomial);
+
+	// compact descriptors: DAISY projected on its first dim principal components and
+	// quantized to uint8 (0 keeps the full 104 bytes DAISY). The PCA basis is either
+	// trained on the DAISY of an image (all pyramid levels) or loaded from a file
+	// written by SavePCA. Without basis the full DAISY is used. LoadPCA rejects a basis
+	// whose size is not the dim set by SetDescriptorDim, it is then trained again.
+	void SetDescriptorDim(int dim);
+	void TrainPCA(FImage& img);
+	bool LoadPCA(const char* filename);
+	bool SavePCA(const char* filename) const;
+	inline bool HasPCA() const { return !_pcaBasis.empty(); };
 
 private:
-	void imDaisy(FImage& img, UCImage& outFtImg);
-	void CrossCheck(IntImage& seeds, FImage& seedsFlow, FImage& seedsFlow2, IntImage& kLabel2, int* valid, float th);
-	float MatchCost(FImage& img1, FImage& img2, UCImage* im1f, UCImage* im2f, int x1, int y1, int x2, int y2);
+	friend class CPMStream;
+
+	// pyramids, features, seeds and the two checked passes, results are left in ws
+	void MatchSeeds(CPMFeatures& feats1, CPMFeatures& feats2, CPMWorkspace& ws, FImage* prevMatches) const;
+	// the flow of prevMatches is multiplied by prevScale, and moved along itself with prevWarp
+	void MatchSeeds(CPMFeatures& feats1, CPMFeatures& feats2, CPMWorkspace& ws, FImage* prevMatches, float prevScale, bool prevWarp) const;
+	int MatchMultiView(CPMFeatures* feats, int nViews, int center, FImage* outMatches, cv::Mat1f* outDisp, CPMWorkspace& ws, CPMStats* outStats, CPMWorkspace* wsLeft) const;
+	// multiplies the known flows of the seeds by scale
+	void ScaleSeedsFlow(FImage& seedsFlow, int numV, float scale) const;
+	int SeedsFlowToMatches(const CPMSeedGrid& grid, IntImage& seeds, FImage& seedsFlow, FImage& outMatches, CPMWorkspace& ws) const;
+	// out is a float image of 2 (u, v) or 1 (u) channels
+	int SeedsFlowToDense(const CPMSeedGrid& grid, IntImage& seeds, FImage& seedsFlow, cv::Mat& out) const;
+	void imDaisy(FImage& img, UCImage& outFtImg) const;
+	// features of the crop [x0, x1) x [y0, y1) of img, the matching ones (DAISY or compact)
+	void CropFeatures(FImage& img, int x0, int y0, int x1, int y1, UCImage& outFtImg, CPMWorkspace& ws) const;
+	// bytes per pixel of the matching features
+	int FeatureChannels() const;
+	// pyramid of img, binomial or sigma-accurate depending on SetBinomialPyramid
+	void BuildPyramid(const FImage& img, FImagePyramid& pyd, double* outLevelTimes = NULL) const;
+	// finest level of pyd whose features (and all coarser ones) fit in the tile memory
+	int FirstGlobalLevel(FImagePyramid& pyd) const;
+	// part [x0, x1) x [y0, y1) of a w x h frame kept in ROI mode
+	void ROIWindow(int w, int h, int* x0, int* y0, int* x1, int* y1) const;
+	void ProjectFeatures(UCImage& ftImg, UCImage& outCompact) const;
+	void UpdatePCACostScale(const cv::Mat& samples);
+	void CrossCheck(const CPMSeedGrid& grid, IntImage& seeds, FImage& seedsFlow, FImage& seedsFlow2, IntImage& kLabel2, int* valid, float th) const;
+	template <bool Stereo>
+	void CrossCheckT(const CPMSeedGrid& grid, IntImage& seeds, FImage& seedsFlow, FImage& seedsFlow2, IntImage& kLabel2, int* valid, float th) const;
+	float MatchCost(const FImageView& img1, const FImageView& img2, const CPMFeatureWindow& im1f, const CPMFeatureWindow& im2f, int x1, int y1, int x2, int y2) const;
+	// stops as soon as the cost can not be lower than bound anymore, the returned value is then
+	// only a partial cost (>= bound) and earlyStop is set
+	float MatchCostBounded(const FImageView& img1, const FImageView& img2, const CPMFeatureWindow& im1f, const CPMFeatureWindow& im2f, int x1, int y1, int x2, int y2, float bound, bool* earlyStop) const;
 
 	// a good initialization is already stored in bestU & bestV
-	int Propogate(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* pyd1f, UCImage* pyd2f, int level, float* radius, int iterCnt, IntImage* pydSeeds, IntImage& neighbors, FImage* pydSeedsFlow, float* bestCosts);
-    void PyramidRandomSearch(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage* pydSeeds, IntImage& neighbors, FImage* pydSeedsFlow);
-	void OnePass(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage& seeds, IntImage& neighbors, FImage* pydSeedsFlow);
-	void UpdateSearchRadius(IntImage& neighbors, FImage* pydSeedsFlow, int level, float* outRadius);
+	// With radius2 set the backward matching (pyd2 to pyd1, pydSeedsFlow2, bestCosts2) is
+	// done as well and its iterations returned in iter2, the two directions are told apart
+	// by the stream (0 and 1) of the random generator.
+	// A level without features is matched tile by tile (PropogateTile)
+	int Propogate(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* pyd1f, UCImage* pyd2f, int level, float* radius, int iterCnt, IntImage* pydSeeds, const CPMSeedGrid& grid, FImage* pydSeedsFlow, float* bestCosts, float* radius2, FImage* pydSeedsFlow2, float* bestCosts2, int* iter2, CPMWorkspace& ws) const;
+	// seeds of the grid rectangle [gx0, gx1) x [gy0, gy1) of a level without features: the tile
+	// is split until the features of its windows fit in budget bytes, then matched. With
+	// radius2 set both directions are matched with the same features when they fit together.
+	// stream is the one of the pyd1 to pyd2 direction, iters[stream] the most iterations a
+	// tile took
+	void PropogateTile(FImagePyramid& pyd1, FImagePyramid& pyd2, int level, int gx0, int gy0, int gx1, int gy1, double budget, IntImage* pydSeeds, const CPMSeedGrid& grid, float* radius, FImage* pydSeedsFlow, float* bestCosts, float* radius2, FImage* pydSeedsFlow2, float* bestCosts2, int stream, int* iters, CPMWorkspace& ws) const;
+	// The T versions are compiled apart for stereo (Stereo = true: 1-D search along x, the
+	// vertical flow stays 0 and is never read) and for optical flow, the functions above
+	// only dispatch on _isStereo once per call. They propagate the seeds of the grid
+	// rectangle [gx0, gx1) x [gy0, gy1), the others are only read.
+	template <bool Stereo>
+	int PropogateT(const FImageView& im1, const FImageView& im2, const CPMFeatureWindow& im1f, const CPMFeatureWindow& im2f, int level, float* radius, int gx0, int gy0, int gx1, int gy1, IntImage* pydSeeds, const CPMSeedGrid& grid, FImage* pydSeedsFlow, float* bestCosts, int stream, CPMWorkspace& ws) const;
+	// propagation and random search of seed idx, returns true if its flow was improved.
+	// rngState is the generator of the random search
+	template <bool Stereo>
+	bool PropogateSeed(const FImageView& im1, const FImageView& im2, const CPMFeatureWindow& im1f, const CPMFeatureWindow& im2f, int idx, IntImage* seeds, const CPMSeedGrid& grid, FImage* seedsFlow, float* bestCosts, float radius, int* vFlags, unsigned int* rngState, long long& evalCount, long long& rejectCount) const;
+    void PyramidRandomSearch(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage* pydSeeds, const CPMSeedGrid& grid, FImage* pydSeedsFlow, CPMWorkspace& ws) const;
+	void OnePass(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, FImage* pydSeedsFlow, CPMWorkspace& ws) const;
+	void UpdateSearchRadius(const CPMSeedGrid& grid, FImage* pydSeedsFlow, int level, float* outRadius) const;
+	template <bool Stereo>
+	void UpdateSearchRadiusT(const CPMSeedGrid& grid, FImage* pydSeedsFlow, int level, float* outRadius) const;
 
 	// minimum circle
 	struct Point{
 		double x, y;
 	};
-	double dist(Point a, Point b);
-	Point intersection(Point u1, Point u2, Point v1, Point v2);
-	Point circumcenter(Point a, Point b, Point c);
+	static double dist(Point a, Point b);
+	static Point intersection(Point u1, Point u2, Point v1, Point v2);
+	static Point circumcenter(Point a, Point b, Point c);
 	// return the radius of the minimal circle
-	float MinimalCircle(float* x, float*y, int n, float* centerX = NULL, float* centerY = NULL);
+	static float MinimalCircle(float* x, float*y, int n, float* centerX = NULL, float* centerY = NULL);
 
 	//
 	int _step;
@@ -73,29 +420,68 @@ private:
 	float _checkThreshold;
 	int _borderWidth;
     int _costCheckThreshold;
+	int _parallelPropagation;
+	int _warmStartRadius;
+	int _warmStartWarp;
+	int _tileMemory;
+	int _roiX, _roiY, _roiW, _roiH;
+	int _binomialPyramid;
 
-	IntImage _kLabels, _kLabels2;
+	int _descDim;
+	cv::Mat _pcaMean;     // 1 x DAISY_DIM
+	cv::Mat _pcaBasis;    // descDim x DAISY_DIM, one principal component per row
+	float _pcaScale;      // quantization: 128 + scale * projection
+	float _pcaCostScale;  // full cost / compact cost
+
+
+    //int Propogate(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* pyd1f, UCImage* pyd2f, int level, float* radius, int iterCnt, IntImage* pydSeeds, IntImage& neighbors, FImage* pydSeedsFlow, float* bestCosts);
+    void PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage* pydSeeds, const CPMSeedGrid& grid, FImage* pydSeedsFlow, FImage* pydSeedsFlow2, CPMWorkspace& ws) const;
+    void TwoPassesAndTwoChecks(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, FImage* pydSeedsFlow, FImage* pydSeedsFlow2, CPMWorkspace& ws) const;
+    void CostCheck(int numV, float* bestCosts, float* bestCost2, IntImage& kLabel2, int* valid, float th) const;
+    void WriteCosts(const char *filename, float* inMat, int numV) const;
+};
 
-	FImagePyramid _pyd1;
-	FImagePyramid _pyd2;
+// Matching of a video given frame by frame: each Push extracts the features of the new
+// frame and matches the newest pair (previous frame -> new frame) in both directions.
+// Only the features of the previous frame are kept (two slots used in turn) and the
+// workspace is reused, so the memory does not grow with the length of the sequence.
+// The CPM gives the parameters and must outlive the stream.
+class CPMStream
+{
+public:
+	CPMStream(const CPM& cpm);
 
-	UCImage* _im1f;
-	UCImage* _im2f;
+	// start the matches of each pair from the ones of the previous pair (see
+	// CPM::Matching), off by default
+	void SetWarmStart(int warmStart);
+	// forget the previous frame, the next one starts a new sequence
+	void Reset();
 
-	FImage* _pydSeedsFlow;
-	FImage* _pydSeedsFlow2;
+	// return false for the first frame of a sequence, which has no pair yet (the outputs are
+	// then left untouched). The flows are written like by CPM::MatchingToFlow, so they are
+	// allocated and initialized by the caller; the matches are like the ones of
+	// CPM::MatchingBidirectional
+	bool Push(FImage& frame, cv::Mat2f& outFwdFlow, cv::Mat2f& outBwdFlow);
+	bool Push(FImage& frame, FImage& outFwdMatches, FImage& outBwdMatches);
+
+	// frames pushed since the start of the sequence
+	inline int FrameCount() const { return _frameCount; };
+	inline const CPMWorkspace& workspace() const { return _ws; };
 
-	IntImage _seeds;
-	IntImage _seeds2;
-	IntImage _neighbors;
-	IntImage _neighbors2;
+private:
+	// not copyable, it owns the features and the workspace
+	CPMStream(const CPMStream&);
+	CPMStream& operator=(const CPMStream&);
 
+	// features of the new frame and matching of the newest pair, false for the first frame
+	bool MatchNewest(FImage& frame);
 
-    //int Propogate(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* pyd1f, UCImage* pyd2f, int level, float* radius, int iterCnt, IntImage* pydSeeds, IntImage& neighbors, FImage* pydSeedsFlow, float* bestCosts);
-    void PyramidRandomSearchWithTwoChecks(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage* pydSeeds, IntImage* pydSeeds2, IntImage& neighbors, IntImage& neighbors2, FImage* pydSeedsFlow, FImage* pydSeedsFlow2);
-    void TwoPassesAndTwoChecks(FImagePyramid& pyd1, FImagePyramid& pyd2, UCImage* im1f, UCImage* im2f, IntImage& seeds, IntImage& seeds2, IntImage& neighbors, IntImage& neighbors2, FImage* pydSeedsFlow, FImage* pydSeedsFlow2);
-    void CostCheck(IntImage& seeds, float* bestCosts, float* bestCost2, IntImage& kLabel2, int* valid, float th);
-    void WriteCosts(const char *filename, float* inMat, int numV);
+	const CPM& _cpm;
+	CPMFeatures _feats[2]; // frame i is in _feats[i % 2]
+	CPMWorkspace _ws;
+	int _frameCount;
+	int _warmStart;
+	FImage _prevMatches; // forward matches of the previous pair, for the warm start
 };
 
 #endif // _CPM_H_
@@ -38,8 +38,10 @@ public:
 	Image(int width,int height,int nchannels=1);
 	Image(const T& value,int _width,int _height,int _nchannels=1);
 	Image(const Image<T>& other);
+	Image(Image<T>&& other); // takes the buffer of other, which is left empty
 	~Image(void);
 	virtual Image<T>& operator=(const Image<T>& other);
+	Image<T>& operator=(Image<T>&& other);
 
 	virtual inline void computeDimension(){nPixels=imWidth*imHeight;nElements=nPixels*nChannels;};
 
@@ -486,6 +488,39 @@ typedef Image<int> IntImage;
 typedef Image<float> FImage;
 typedef Image<double> DImage;
 
+// Non-owning view on the buffer of an image (or any interleaved buffer, e.g. the data
+// of a continuous cv::Mat), to pass images around without copying them.
+// The view must not outlive the buffer.
+template <class T>
+class ImageView
+{
+public:
+	T* pData;
+protected:
+	int imWidth, imHeight, nChannels;
+public:
+	ImageView() : pData(NULL), imWidth(0), imHeight(0), nChannels(0) {};
+	ImageView(Image<T>& image) : pData(image.pData), imWidth(image.width()), imHeight(image.height()), nChannels(image.nchannels()) {};
+	ImageView(T* data, int width, int height, int nchannels = 1) : pData(data), imWidth(width), imHeight(height), nChannels(nchannels) {};
+
+	inline const T& operator [] (int index) const {return pData[index];};
+	inline T& operator[](int index) {return pData[index];};
+
+	inline T* rowPtr(int row) const { return pData + row*imWidth*nChannels; };
+	inline T* pixPtr(int row, int col) const { return pData + (row*imWidth + col)*nChannels; };
+
+	inline int width() const {return imWidth;};
+	inline int height() const {return imHeight;};
+	inline int nchannels() const {return nChannels;};
+	inline int npixels() const {return imWidth*imHeight;};
+	inline int nelements() const {return imWidth*imHeight*nChannels;};
+	bool IsEmpty() const {return pData == NULL || imWidth*imHeight*nChannels == 0;};
+};
+
+typedef ImageView<unsigned char> UCImageView;
+typedef ImageView<int> IntImageView;
+typedef ImageView<float> FImageView;
+
 //------------------------------------------------------------------------------------------
 // constructor
 //------------------------------------------------------------------------------------------
@@ -571,6 +606,25 @@ Image<T>::Image(const Image<T>& other)
 	copyData(other);
 }
 
+//------------------------------------------------------------------------------------------
+// move constructor
+//------------------------------------------------------------------------------------------
+template <class T>
+Image<T>::Image(Image<T>&& other)
+{
+	pData=other.pData;
+	imWidth=other.imWidth;
+	imHeight=other.imHeight;
+	nChannels=other.nChannels;
+	nPixels=other.nPixels;
+	nElements=other.nElements;
+	IsDerivativeImage=other.IsDerivativeImage;
+	colorType=other.colorType;
+
+	other.pData=NULL;
+	other.imWidth=other.imHeight=other.nChannels=other.nPixels=other.nElements=0;
+}
+
 //------------------------------------------------------------------------------------------
 // destructor
 //------------------------------------------------------------------------------------------
@@ -705,6 +759,26 @@ Image<T>& Image<T>::operator=(const Image<T>& other)
 	return *this;
 }
 
+template <class T>
+Image<T>& Image<T>::operator=(Image<T>&& other)
+{
+	if(this==&other)
+		return *this;
+	clear();
+	pData=other.pData;
+	imWidth=other.imWidth;
+	imHeight=other.imHeight;
+	nChannels=other.nChannels;
+	nPixels=other.nPixels;
+	nElements=other.nElements;
+	IsDerivativeImage=other.IsDerivativeImage;
+	colorType=other.colorType;
+
+	other.pData=NULL;
+	other.imWidth=other.imHeight=other.nChannels=other.nPixels=other.nElements=0;
+	return *this;
+}
+
 template <class T>
 bool Image<T>::IsFloat() const
 {
@@ -21,8 +21,217 @@ public:
 	template <class T>
 	static void imSIFT(const Image<T>& imsrc, UCImage& imsift, const vector<int> cellSizeVect, int stepSize = 1, bool IsBoundaryIncluded = false, int nBins = 8);
 
+	// dense DAISY (Tola et al., PAMI 2010) for every pixel, the layout of a descriptor is
+	// [center | ring 0 | ... | ring nRings-1], nHistograms histograms of nBins orientations per ring,
+	// padded with zeros to a multiple of dimAlign bytes
+	template <class T>
+	static void imDAISY(const Image<T>& imsrc, UCImage& imdaisy, float radius = 5, int nRings = 3, int nHistograms = 4, int nBins = 8, int dimAlign = 1);
+	// distance in pixels a DAISY descriptor depends on (gradient, cascaded smoothing and
+	// sampling ring), so that the DAISY of a crop is the same as the one of the whole image
+	// everywhere but in a band of that width along the crop borders inside the image
+	static int DAISYFootprint(float radius = 5, int nRings = 3);
+
+private:
+	// pDst += w * pSrc
+	static inline void accumulate(float* pDst, const float* pSrc, float w, int n);
+
+	// separable gaussian smoothing of nBins interleaved orientation layers
+	static void smoothLayers(const float* pSrc, float* pDst, float* pTemp, int width, int height, int nBins, float sigma);
 };
 
+inline void ImageFeature::accumulate(float* pDst, const float* pSrc, float w, int n)
+{
+	int k = 0;
+#ifdef WITH_SSE
+	__m128 _w = _mm_set_ps1(w);
+	for (; k + 4 <= n; k += 4){
+		__m128 r = _mm_mul_ps(_mm_loadu_ps(pSrc + k), _w);
+		_mm_storeu_ps(pDst + k, _mm_add_ps(_mm_loadu_ps(pDst + k), r));
+	}
+#endif
+	for (; k < n; k++)
+		pDst[k] += pSrc[k] * w;
+}
+
+inline void ImageFeature::smoothLayers(const float* pSrc, float* pDst, float* pTemp, int width, int height, int nBins, float sigma)
+{
+	int fsize = __max((int)(sigma * 3 + 0.5), 1);
+	float* gFilter = new float[fsize * 2 + 1];
+	float sum = 0;
+	for (int i = -fsize; i <= fsize; i++){
+		gFilter[i + fsize] = exp(-(float)(i*i) / (2 * sigma*sigma));
+		sum += gFilter[i + fsize];
+	}
+	for (int i = 0; i < 2 * fsize + 1; i++)
+		gFilter[i] /= sum;
+
+	int lineWidth = width*nBins;
+
+	// horizontal, the nBins layers of a pixel are filtered together
+#pragma omp parallel for
+	for (int i = 0; i < height; i++){
+		const float* src = pSrc + i*lineWidth;
+		float* dst = pTemp + i*lineWidth;
+		memset(dst, 0, sizeof(float)*lineWidth);
+		for (int j = 0; j < width; j++){
+			for (int l = -fsize; l <= fsize; l++){
+				int jj = ImageProcessing::EnforceRange(j + l, width);
+				accumulate(dst + j*nBins, src + jj*nBins, gFilter[l + fsize], nBins);
+			}
+		}
+	}
+
+	// vertical, whole lines at once
+#pragma omp parallel for
+	for (int i = 0; i < height; i++){
+		float* dst = pDst + i*lineWidth;
+		memset(dst, 0, sizeof(float)*lineWidth);
+		for (int l = -fsize; l <= fsize; l++){
+			int ii = ImageProcessing::EnforceRange(i + l, height);
+			accumulate(dst, pTemp + ii*lineWidth, gFilter[l + fsize], lineWidth);
+		}
+	}
+
+	delete[] gFilter;
+}
+
+inline int ImageFeature::DAISYFootprint(float radius, int nRings)
+{
+	// same kernel sizes as imDAISY and smoothLayers
+	int footprint = 1 + (int)ceil(radius);
+	float lastSigma = 0;
+	for (int r = 0; r < nRings; r++){
+		float sigma = radius*(r + 1) / (2 * nRings);
+		float incSigma = sqrt(sigma*sigma - lastSigma*lastSigma);
+		footprint += __max((int)(incSigma * 3 + 0.5), 1);
+		lastSigma = sigma;
+	}
+	return footprint;
+}
+
+template <class T>
+void ImageFeature::imDAISY(const Image<T>& imsrc, UCImage& imdaisy, float radius, int nRings, int nHistograms, int nBins, int dimAlign)
+{
+	int width = imsrc.width(), height = imsrc.height();
+	int daisydim = (nRings*nHistograms + 1)*nBins;
+	int paddedDim = (daisydim + dimAlign - 1) / dimAlign * dimAlign;
+
+	FImage imgray;
+	imsrc.desaturate(imgray);
+
+	// oriented gradient layers: max(cos(theta)*dx + sin(theta)*dy, 0)
+	FImage layers(width, height, nBins);
+	float* cosTable = new float[nBins];
+	float* sinTable = new float[nBins];
+	for (int k = 0; k < nBins; k++){
+		cosTable[k] = cos(M_PI * 2 * k / nBins);
+		sinTable[k] = sin(M_PI * 2 * k / nBins);
+	}
+#pragma omp parallel for
+	for (int i = 0; i < height; i++){
+		const float* row = imgray.pData + i*width;
+		const float* rowUp = imgray.pData + __max(i - 1, 0)*width;
+		const float* rowDown = imgray.pData + __min(i + 1, height - 1)*width;
+		float* dst = layers.pData + i*width*nBins;
+		for (int j = 0; j < width; j++){
+			float dx = (row[__min(j + 1, width - 1)] - row[__max(j - 1, 0)]) * 0.5f;
+			float dy = (rowDown[j] - rowUp[j]) * 0.5f;
+			int k = 0;
+#ifdef WITH_SSE
+			__m128 _dx = _mm_set_ps1(dx), _dy = _mm_set_ps1(dy), _zero = _mm_setzero_ps();
+			for (; k + 4 <= nBins; k += 4){
+				__m128 r = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(cosTable + k), _dx), _mm_mul_ps(_mm_loadu_ps(sinTable + k), _dy));
+				_mm_storeu_ps(dst + k, _mm_max_ps(r, _zero));
+			}
+#endif
+			for (; k < nBins; k++)
+				dst[k] = __max(cosTable[k] * dx + sinTable[k] * dy, 0);
+			dst += nBins;
+		}
+	}
+	delete[] cosTable;
+	delete[] sinTable;
+
+	// one smoothed copy of the layers per ring, sigma grows with the ring radius,
+	// each of them is obtained from the previous one (cascaded smoothing)
+	FImage temp(width, height, nBins);
+	FImage* ringLayers = new FImage[nRings];
+	float lastSigma = 0;
+	for (int r = 0; r < nRings; r++){
+		float sigma = radius*(r + 1) / (2 * nRings);
+		float incSigma = sqrt(sigma*sigma - lastSigma*lastSigma);
+		const FImage& src = (r == 0) ? layers : ringLayers[r - 1];
+		ringLayers[r].allocate(width, height, nBins);
+		smoothLayers(src.pData, ringLayers[r].pData, temp.pData, width, height, nBins, incSigma);
+		lastSigma = sigma;
+	}
+
+	// sampling grid
+	int nSamples = nRings*nHistograms;
+	int* sampleX = new int[nSamples];
+	int* sampleY = new int[nSamples];
+	for (int r = 0; r < nRings; r++){
+		float rr = radius*(r + 1) / nRings;
+		for (int t = 0; t < nHistograms; t++){
+			float theta = M_PI * 2 * t / nHistograms;
+			sampleX[r*nHistograms + t] = floor(rr*cos(theta) + 0.5);
+			sampleY[r*nHistograms + t] = floor(rr*sin(theta) + 0.5);
+		}
+	}
+
+	if (!imdaisy.matchDimension(width, height, paddedDim))
+		imdaisy.allocate(width, height, paddedDim);
+
+	// gather the histograms, normalize the whole descriptor and quantize
+#pragma omp parallel for
+	for (int i = 0; i < height; i++){
+		FImage desc(daisydim, 1);
+		for (int j = 0; j < width; j++){
+			memcpy(desc.pData, ringLayers[0].pData + (i*width + j)*nBins, sizeof(float)*nBins);
+			for (int s = 0; s < nSamples; s++){
+				int x = ImageProcessing::EnforceRange(j + sampleX[s], width);
+				int y = ImageProcessing::EnforceRange(i + sampleY[s], height);
+				memcpy(desc.pData + (s + 1)*nBins, ringLayers[s / nHistograms].pData + (y*width + x)*nBins, sizeof(float)*nBins);
+			}
+
+			unsigned char* dst = imdaisy.pData + (i*width + j)*paddedDim;
+			int k = 0;
+#ifdef WITH_SSE
+			hu_m128 r0, r1;
+			r0.m = _mm_setzero_ps();
+			for (k = 0; k + 4 <= daisydim; k += 4){
+				r1.m = _mm_loadu_ps(desc.pData + k);
+				r0.m = _mm_add_ps(r0.m, _mm_mul_ps(r1.m, r1.m));
+			}
+			float norm2 = r0.m128_f32[0] + r0.m128_f32[1] + r0.m128_f32[2] + r0.m128_f32[3];
+			for (; k < daisydim; k++)
+				norm2 += desc.pData[k] * desc.pData[k];
+			float scale = norm2 > 0 ? 255. / sqrt(norm2) : 0;
+
+			__m128 _scale = _mm_set_ps1(scale), _v255 = _mm_set_ps1(255.);
+			for (k = 0; k + 4 <= daisydim; k += 4){
+				r1.m = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(desc.pData + k), _scale), _v255);
+				dst[k] = r1.m128_f32[0];
+				dst[k + 1] = r1.m128_f32[1];
+				dst[k + 2] = r1.m128_f32[2];
+				dst[k + 3] = r1.m128_f32[3];
+			}
+#else
+			float norm2 = desc.norm2();
+			float scale = norm2 > 0 ? 255. / sqrt(norm2) : 0;
+#endif
+			for (; k < daisydim; k++)
+				dst[k] = (unsigned char)__min(desc.pData[k] * scale, 255);
+			for (; k < paddedDim; k++)
+				dst[k] = 0;
+		}
+	}
+
+	delete[] sampleX;
+	delete[] sampleY;
+	delete[] ringLayers;
+}
+
 template <class T>
 void ImageFeature::imSIFT(const Image<T>& imsrc, UCImage &imsift, int cellSize, int stepSize, bool IsBoundaryIncluded, int nBins)
 {
@@ -14,10 +14,11 @@
 template <class T>
 inline void* xmalloc(T size){
 #ifdef WITH_SSE
+// cache line aligned, so that the rows of a plane-per-row buffer padded to 64 bytes stay aligned
 #ifdef WIN32
-	return _aligned_malloc(size, 32);
+	return _aligned_malloc(size, 64);
 #else
-	return memalign(32, size);
+	return memalign(64, size);
 #endif
 #else
 	return malloc(size);
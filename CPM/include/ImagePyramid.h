@@ -2,6 +2,8 @@
 #define _GaussianPyramid_h
 
 #include "Image.h"
+#include "Util.h"
+#include "PyrDown.h"
 
 template <class T>
 class ImagePyramid
@@ -11,10 +13,15 @@ private:
 	int nLevels;
 	float fRatio;
 public:
-	ImagePyramid(void){ ImPyramid = NULL; };
+	ImagePyramid(void){ ImPyramid = NULL; nLevels = 0; };
 	~ImagePyramid(void){if(ImPyramid != NULL) delete[]ImPyramid;};
 	inline Image<T>& operator[](int level) { return ImPyramid[level]; };
-	void ConstructPyramid(const FImage& image, float ratio = 0.8, int minWidth = 30);
+	inline const Image<T>& operator[](int level) const { return ImPyramid[level]; };
+	// outLevelTimes, when given, receives the time [s] spent on each level
+	void ConstructPyramid(const FImage& image, float ratio = 0.8, int minWidth = 30, double* outLevelTimes = NULL);
+	// ratio 0.5 pyramid, each level blurred and decimated from the previous one with the
+	// 5-tap binomial filter (SIMD, rows on all threads); same level sizes as ConstructPyramid
+	void ConstructPyramidBinomial(const FImage& image, int minWidth = 30, double* outLevelTimes = NULL);
 	void ConstructPyramidLevels(const FImage& image, float ratio = 0.8, int _nLevels = 2);
 	void displayTop(const char* filename){ ImPyramid[nLevels - 1].imwrite(filename); };
 	inline int nlevels() const {return nLevels;};
@@ -53,18 +60,25 @@ foo.imresize(ImPyramid[i],pow(ratio,i));
 // this is the fast way
 //---------------------------------------------------------------------------------------
 template <class T>
-void ImagePyramid<T>::ConstructPyramid(const FImage& image, float ratio /*= 0.8*/, int minWidth /*= 30*/)
+void ImagePyramid<T>::ConstructPyramid(const FImage& image, float ratio /*= 0.8*/, int minWidth /*= 30*/, double* outLevelTimes /*= NULL*/)
 {
 	// the ratio cannot be arbitrary numbers
 	if (ratio>0.98 || ratio<0.4)
 		ratio = 0.75;
 	// first decide how many levels
-	nLevels = log((float)minWidth / image.width()) / log(ratio);
+	int newLevels = log((float)minWidth / image.width()) / log(ratio);
 	fRatio = ratio;
-	if (ImPyramid != NULL)
-		delete[]ImPyramid;
-	ImPyramid = new FImage[nLevels];
+	// keep the levels of the previous call when possible (buffers are reused)
+	if (ImPyramid == NULL || newLevels != nLevels){
+		if (ImPyramid != NULL)
+			delete[]ImPyramid;
+		ImPyramid = new FImage[newLevels];
+	}
+	nLevels = newLevels;
+	CTimer t;
 	ImPyramid[0].copyData(image);
+	if (outLevelTimes)
+		outLevelTimes[0] = t.toc();
 	float baseSigma = (1 / ratio - 1);
 	int n = log(0.25) / log(ratio);
 	float nSigma = baseSigma*n;
@@ -83,6 +97,38 @@ void ImagePyramid<T>::ConstructPyramid(const FImage& image, float ratio /*= 0.8*
 			float rate = (float)pow(ratio, i)*image.width() / foo.width();
 			foo.imresize(ImPyramid[i], rate);
 		}
+		if (outLevelTimes)
+			outLevelTimes[i] = t.toc();
+	}
+}
+
+template <class T>
+void ImagePyramid<T>::ConstructPyramidBinomial(const FImage& image, int minWidth /*= 30*/, double* outLevelTimes /*= NULL*/)
+{
+	float ratio = 0.5;
+	int newLevels = log((float)minWidth / image.width()) / log(ratio);
+	fRatio = ratio;
+	if (ImPyramid == NULL || newLevels != nLevels){
+		if (ImPyramid != NULL)
+			delete[]ImPyramid;
+		ImPyramid = new FImage[newLevels];
+	}
+	nLevels = newLevels;
+	CTimer t;
+	ImPyramid[0].copyData(image);
+	if (outLevelTimes)
+		outLevelTimes[0] = t.toc();
+	int nch = image.nchannels();
+	for (int i = 1; i < nLevels; i++)
+	{
+		const FImage& src = ImPyramid[i - 1];
+		int w = src.width() / 2;
+		int h = src.height() / 2;
+		if (!ImPyramid[i].matchDimension(w, h, nch))
+			ImPyramid[i].allocate(w, h, nch);
+		pyrdown_binomial(src.data(), src.width(), src.height(), nch, src.width() * nch, ImPyramid[i].data(), w * nch);
+		if (outLevelTimes)
+			outLevelTimes[i] = t.toc();
 	}
 }
 
@@ -92,11 +138,13 @@ void ImagePyramid<T>::ConstructPyramidLevels(const FImage& image, float ratio /*
 	// the ratio cannot be arbitrary numbers
 	if (ratio>0.98 || ratio<0.4)
 		ratio = 0.75;
-	nLevels = _nLevels;
 	fRatio = ratio;
-	if (ImPyramid != NULL)
-		delete[]ImPyramid;
-	ImPyramid = new FImage[nLevels];
+	if (ImPyramid == NULL || _nLevels != nLevels){
+		if (ImPyramid != NULL)
+			delete[]ImPyramid;
+		ImPyramid = new FImage[_nLevels];
+	}
+	nLevels = _nLevels;
 	ImPyramid[0].copyData(image);
 	float baseSigma = (1 / ratio - 1);
 	int n = log(0.25) / log(ratio);
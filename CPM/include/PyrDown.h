@@ -0,0 +1,117 @@
+#ifndef _PyrDown_h
+#define _PyrDown_h
+
+/*
+One level of a binomial pyramid: the image is blurred with the 5-tap binomial filter
+[1 4 6 4 1] / 16 in both directions and every other pixel is kept. dst pixel (j, i)
+is centered on src pixel (2j + 1, 2i + 1), like a resize by 0.5, and the borders are
+replicated. Cascading it gives the levels of a ratio 0.5 pyramid without blurring the
+full resolution image with a growing kernel.
+
+Plain C so that it can be used by both CPM (interleaved channels) and the variational
+refinement (one plane per channel).
+*/
+
+#include <stdlib.h>
+#ifdef WITH_SSE
+#include <xmmintrin.h>
+#endif
+
+static inline int pyrdown_clamp(int x, int n)
+{
+	return x < 0 ? 0 : (x >= n ? n - 1 : x);
+}
+
+/* rows [i0, i1) of dst, tmp holds one row of w * nch floats */
+static inline void pyrdown_binomial_rows(const float* src, int w, int h, int nch, int srcStride, float* dst, int dstStride, int i0, int i1, float* tmp)
+{
+	int n = w * nch;
+	int dw = w / 2;
+	int i, k, j, c;
+	for (i = i0; i < i1; i++){
+		/* vertical pass on the 5 source rows around 2i + 1 */
+		const float* r0 = src + pyrdown_clamp(2 * i - 1, h) * srcStride;
+		const float* r1 = src + pyrdown_clamp(2 * i, h) * srcStride;
+		const float* r2 = src + pyrdown_clamp(2 * i + 1, h) * srcStride;
+		const float* r3 = src + pyrdown_clamp(2 * i + 2, h) * srcStride;
+		const float* r4 = src + pyrdown_clamp(2 * i + 3, h) * srcStride;
+		k = 0;
+#ifdef WITH_SSE
+		{
+			const __m128 four = _mm_set1_ps(4.f), six = _mm_set1_ps(6.f);
+			for (; k + 4 <= n; k += 4){
+				__m128 s = _mm_add_ps(_mm_loadu_ps(r0 + k), _mm_loadu_ps(r4 + k));
+				s = _mm_add_ps(s, _mm_mul_ps(four, _mm_add_ps(_mm_loadu_ps(r1 + k), _mm_loadu_ps(r3 + k))));
+				s = _mm_add_ps(s, _mm_mul_ps(six, _mm_loadu_ps(r2 + k)));
+				_mm_storeu_ps(tmp + k, s);
+			}
+		}
+#endif
+		for (; k < n; k++){
+			tmp[k] = (r0[k] + r4[k]) + 4.f * (r1[k] + r3[k]) + 6.f * r2[k];
+		}
+
+		/* horizontal pass and decimation */
+		float* out = dst + i * dstStride;
+		j = 0;
+		if (nch == 1){
+			/* first and last outputs read replicated borders */
+			for (; j < dw && 2 * j - 1 < 0; j++){
+				int x = 2 * j + 1;
+				out[j] = (tmp[pyrdown_clamp(x - 2, w)] + tmp[pyrdown_clamp(x + 2, w)])
+					+ 4.f * (tmp[x - 1] + tmp[pyrdown_clamp(x + 1, w)]) + 6.f * tmp[x];
+				out[j] *= 1.f / 256;
+			}
+#ifdef WITH_SSE
+			{
+				const __m128 four = _mm_set1_ps(4.f), six = _mm_set1_ps(6.f), norm = _mm_set1_ps(1.f / 256);
+				/* 4 outputs read tmp[2j - 1 .. 2j + 10] */
+				for (; j + 4 <= dw && 2 * j + 10 < w; j += 4){
+					const float* a = tmp + 2 * j - 1;
+					__m128 v0 = _mm_loadu_ps(a), v1 = _mm_loadu_ps(a + 4), v2 = _mm_loadu_ps(a + 8);
+					__m128 u0 = _mm_loadu_ps(a + 2), u1 = _mm_loadu_ps(a + 6);
+					__m128 e0 = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0)); /* a[2m] */
+					__m128 o0 = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1)); /* a[2m + 1] */
+					__m128 e2 = _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(2, 0, 2, 0)); /* a[2m + 4] */
+					__m128 e1 = _mm_shuffle_ps(u0, u1, _MM_SHUFFLE(2, 0, 2, 0)); /* a[2m + 2] */
+					__m128 o1 = _mm_shuffle_ps(u0, u1, _MM_SHUFFLE(3, 1, 3, 1)); /* a[2m + 3] */
+					__m128 s = _mm_add_ps(_mm_add_ps(e0, e2), _mm_mul_ps(four, _mm_add_ps(o0, o1)));
+					s = _mm_add_ps(s, _mm_mul_ps(six, e1));
+					_mm_storeu_ps(out + j, _mm_mul_ps(s, norm));
+				}
+			}
+#endif
+		}
+		for (; j < dw; j++){
+			int x = 2 * j + 1;
+			const float* t0 = tmp + pyrdown_clamp(x - 2, w) * nch;
+			const float* t1 = tmp + (x - 1) * nch;
+			const float* t2 = tmp + x * nch;
+			const float* t3 = tmp + pyrdown_clamp(x + 1, w) * nch;
+			const float* t4 = tmp + pyrdown_clamp(x + 2, w) * nch;
+			for (c = 0; c < nch; c++){
+				float s = (t0[c] + t4[c]) + 4.f * (t1[c] + t3[c]) + 6.f * t2[c];
+				out[j * nch + c] = s * (1.f / 256);
+			}
+		}
+	}
+}
+
+/* dst is (w / 2) x (h / 2) with nch interleaved channels; strides are in floats.
+   The rows of dst are shared by the threads */
+static inline void pyrdown_binomial(const float* src, int w, int h, int nch, int srcStride, float* dst, int dstStride)
+{
+	int dh = h / 2;
+	#pragma omp parallel if(dh * w >= 256 * 256)
+	{
+		float* tmp = (float*)malloc(sizeof(float) * w * nch);
+		int i;
+		#pragma omp for schedule(static)
+		for (i = 0; i < dh; i++){
+			pyrdown_binomial_rows(src, w, h, nch, srcStride, dst, dstStride, i, i + 1, tmp);
+		}
+		free(tmp);
+	}
+}
+
+#endif
@@ -55,6 +55,16 @@ std::ostream& operator<< (std::ostream& os, cpmpf_parameters &cpmpf_param)
     os << "CPM_cost_threshold: "      << cpmpf_param.CPM_cost_threshold << std::endl;
 	os << "CPM_stereo_flag: "         << cpmpf_param.CPM_stereo_flag << std::endl;
 	os << "CPM_step: "                << cpmpf_param.CPM_step << std::endl;
+	os << "CPM_desc_dim: "            << cpmpf_param.CPM_desc_dim << std::endl;
+	os << "CPM_pca_file: "            << cpmpf_param.CPM_pca_file << std::endl;
+	os << "CPM_parallel: "            << cpmpf_param.CPM_parallel << std::endl;
+	os << "CPM_warm_start: "          << cpmpf_param.CPM_warm_start << std::endl;
+	os << "CPM_warm_radius: "         << cpmpf_param.CPM_warm_radius << std::endl;
+	os << "CPM_tile_mb: "             << cpmpf_param.CPM_tile_mb << std::endl;
+	os << "CPM_multiview: "           << cpmpf_param.CPM_multiview << std::endl;
+	os << "CPM_binomial_pyramid: "    << cpmpf_param.CPM_binomial_pyramid << std::endl;
+	os << "CPM_roi: "                 << cpmpf_param.CPM_roi[0] << " " << cpmpf_param.CPM_roi[1] << " " << cpmpf_param.CPM_roi[2] << " " << cpmpf_param.CPM_roi[3] << std::endl;
+	os << "CPM_stats_file: "          << cpmpf_param.CPM_stats_file << std::endl;
 	
 	os << "PF_iter_XY: "    << cpmpf_param.PF_iter_XY << std::endl;
 	os << "PF_lambda_XY: "  << cpmpf_param.PF_lambda_XY << std::endl;
@@ -82,6 +92,16 @@ void cpmpf_parameters::set_dataset(std::string dataset_name) {
     CPM_cost_threshold = 1880;
     CPM_stereo_flag = 0;
     CPM_step = 3;
+    CPM_desc_dim = 0;
+    CPM_pca_file = "";
+    CPM_parallel = 0;
+    CPM_warm_start = 0;
+    CPM_warm_radius = 16;
+    CPM_tile_mb = 0;
+    CPM_multiview = 0;
+    CPM_binomial_pyramid = 0;
+    CPM_roi[0] = CPM_roi[1] = CPM_roi[2] = CPM_roi[3] = 0;
+    CPM_stats_file = "";
 
     PF_iter_XY = 5;
     PF_lambda_XY = 0;
@@ -129,6 +149,17 @@ void cpmpf_parameters::to_CPM_params(CPM &cpm){
 	cpm.SetMaxDisplacement(CPM_max_displacement);
 	cpm.SetCheckThreshold(CPM_check_threshold);
     cpm.SetCostCheckThreshold(CPM_cost_threshold);
+    cpm.SetDescriptorDim(CPM_desc_dim);
+    cpm.SetParallelPropagation(CPM_parallel);
+    cpm.SetWarmStartRadius(CPM_warm_radius);
+    cpm.SetWarmStartWarp(CPM_warm_start == 2);
+    cpm.SetTileMemory(CPM_tile_mb);
+    cpm.SetROI(CPM_roi[0], CPM_roi[1], CPM_roi[2], CPM_roi[3]);
+    cpm.SetBinomialPyramid(CPM_binomial_pyramid);
+    if(CPM_desc_dim > 0 && !CPM_pca_file.empty()){
+        // a missing file, or one trained for another dimension, is not an error: the basis is then trained and saved there
+        cpm.LoadPCA(CPM_pca_file.c_str());
+    }
 }
 
 void cpmpf_parameters::to_variational_params(variational_params_t *v_params){
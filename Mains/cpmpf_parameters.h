@@ -43,6 +43,16 @@ public:
     int CPM_cost_threshold;
     int CPM_stereo_flag;
     int CPM_step;
+    int CPM_desc_dim;          // 0: full DAISY, otherwise number of PCA components
+    std::string CPM_pca_file;  // PCA basis to load (or to save after training)
+    int CPM_parallel;          // parallel propagation inside a pair, for single pairs
+    int CPM_warm_start;        // 0: random init, 1: init from the previous pair, 2: same, warped along the flow
+    int CPM_warm_radius;       // search radius around the previous flow (pixels)
+    int CPM_tile_mb;           // 0: whole levels, otherwise memory (MB) for the features of each pair, fine levels in tiles
+    int CPM_multiview;         // CPMPF_DISP: 0: adjacent pairs matched independently, 1: center view against all the others
+    int CPM_binomial_pyramid;  // 0: pyramid levels blurred with their own sigma (original), 1: cascaded binomial blur-and-decimate
+    int CPM_roi[4];            // x, y, width, height of the region to match, whole frames if the width is 0
+    std::string CPM_stats_file; // JSON file receiving the per-level timings and counters of every pair, none if empty
 
     // Permeability filter 
     // spatial parameters
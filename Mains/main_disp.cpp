@@ -21,6 +21,10 @@ extern "C" {
 #include "utils.h"
 #include "cpmpf_parameters.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 
 void Usage()
@@ -52,6 +56,14 @@ void Usage()
         << "    -CPM_cth                                   matching cost check threshold" <<endl
         << "    -CPM_stereo                                stereo flag" <<endl
         << "    -CPM_nstep                                 number of step giving the final result resolution" <<endl
+        << "    -CPM_desc_dim                              number of PCA components of the compact descriptor, 0 keeps the full DAISY" <<endl
+        << "    -CPM_pca                                   PCA basis file, loaded if it exists, otherwise trained on the first frame and saved" <<endl
+        << "    -CPM_par                                   parallel propagation inside each pair, useful when there are fewer pairs than cores" <<endl
+        << "    -CPM_tile_mb                               memory (MB) for the features of a pair, the fine levels of large frames are then matched in tiles; 0 (default) is unbounded" <<endl
+        << "    -CPM_multiview                             1: match the center view against all the others, each pair seeded from its neighbour, instead of the adjacent pairs independently" <<endl
+        << "    -CPM_bin_pyd                               1: fast pyramid (cascaded 5-tap binomial blur-and-decimate), 0 (default): each level blurred with its own sigma" <<endl
+        << "    -CPM_roi                                   x y w h: only match this region (and the part of the frames it can move to), the disparity elsewhere is left unknown" <<endl
+        << "    -CPM_stats                                 JSON file receiving the per-level timings and counters (iterations, update ratios, check rejections) of every pair" <<endl
         << "  PF:" << endl
         << "    Spatial parameters:" << endl
         << "    -PF_iter_XY                                number of iterations" << endl
@@ -101,6 +113,24 @@ void parse_cmd(int argc, char** argv, int current_arg, cpmpf_parameters &cpm_pf_
             cpm_pf_params.CPM_stereo_flag = atoi(argv[current_arg++]);
         else if( isarg("-CPM_nstep") )
             cpm_pf_params.CPM_step = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_desc_dim") )
+            cpm_pf_params.CPM_desc_dim = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_pca") )
+            cpm_pf_params.CPM_pca_file = string(argv[current_arg++]);
+        else if( isarg("-CPM_par") )
+            cpm_pf_params.CPM_parallel = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_tile_mb") )
+            cpm_pf_params.CPM_tile_mb = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_multiview") )
+            cpm_pf_params.CPM_multiview = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_bin_pyd") )
+            cpm_pf_params.CPM_binomial_pyramid = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_roi") ) {
+            for (int k = 0; k < 4; k++)
+                cpm_pf_params.CPM_roi[k] = atoi(argv[current_arg++]);
+        }
+        else if( isarg("-CPM_stats") )
+            cpm_pf_params.CPM_stats_file = string(argv[current_arg++]);
         
         // Permeability Filter 
         // spatial parameters
@@ -297,34 +327,80 @@ int main(int argc, char** argv)
     
     CPM cpm;
     cpm_pf_params.to_CPM_params(cpm);
+    if(ang_dir == "ver") // ROI in the rotated images
+    {
+        const int* roi = cpm_pf_params.CPM_roi;
+        cpm.SetROI(roi[1], height - roi[0] - roi[2], roi[3], roi[2]);
+    }
+    if (cpm_pf_params.CPM_desc_dim > 0 && !cpm.HasPCA()) {
+        FImage img(width, height, nch);
+        Mat3f2FImage(input_RGB_images_vec[0], img);
+        cpm.TrainPCA(img);
+        if (!cpm_pf_params.CPM_pca_file.empty())
+            cpm.SavePCA(cpm_pf_params.CPM_pca_file.c_str());
+    }
 
-    vector<Mat1f> cpm_disp_fwd(nb_imgs-1), cpm_disp_bwd(nb_imgs-1);
-    
-    #pragma omp parallel for 
-    for (size_t i = 0; i < nb_imgs - 1; ++i) {
-        FImage img1(width, height, nch);
-        FImage img2(width, height, nch);
-        
-        Mat3f2FImage(input_RGB_images_vec[i],   img1);
-        Mat3f2FImage(input_RGB_images_vec[i+1], img2);
-
-        // Forward flow
-        FImage matches;
-        cpm.Matching(img1, img2, matches);
-
-        Mat1f disp_fwd(height, width, kMOVEMENT_UNKNOWN);
-        Match2Disp(matches, disp_fwd, "hor");
-        cpm_disp_fwd[i] = disp_fwd;
+    // one matching workspace per thread, reused for all the pairs it processes
+    int nb_threads = 1;
+#ifdef _OPENMP
+    nb_threads = omp_get_max_threads();
+#endif
+    vector<CPMWorkspace> cpm_workspaces(nb_threads);
 
-        // Backward flow
-        matches.clear();
-        cpm.Matching(img2, img1, matches);
+    // pyramid and features of each frame, built once and shared by the pairs it belongs to
+    vector<CPMFeatures> cpm_features(nb_imgs);
+    #pragma omp parallel for 
+    for (size_t i = 0; i < nb_imgs; ++i) {
+        FImage img(width, height, nch);
+        Mat3f2FImage(input_RGB_images_vec[i], img);
+        cpm.ExtractFeatures(img, cpm_features[i]);
+    }
 
-        Mat1f disp_bwd(height, width, kMOVEMENT_UNKNOWN);
-        Match2Disp(matches, disp_bwd, "hor");
-        cpm_disp_bwd[i] = disp_bwd;
+    vector<Mat1f> cpm_disp_fwd(nb_imgs-1), cpm_disp_bwd(nb_imgs-1);
+    vector<CPMStats> cpm_stats(nb_imgs-1);
+
+    if (cpm_pf_params.CPM_multiview) {
+        // all the views against the center one, each pair seeded from its neighbour. The
+        // disparity of every view for one view step gives the ones of the adjacent pairs
+        int center = nb_imgs / 2;
+        vector<Mat1f> cpm_disp_step(nb_imgs);
+        vector<CPMStats> cpm_view_stats(nb_imgs);
+        for (size_t i = 0; i < nb_imgs; ++i)
+            cpm_disp_step[i] = Mat1f(height, width, kMOVEMENT_UNKNOWN);
+        // the right and left chains on two threads, unless -CPM_par uses them inside each pair
+        CPMWorkspace* ws_left = (nb_threads > 1 && !cpm_pf_params.CPM_parallel) ? &cpm_workspaces[1] : NULL;
+        cpm.MatchingMultiViewToDisp(&cpm_features[0], nb_imgs, center, &cpm_disp_step[0], cpm_workspaces[0], &cpm_view_stats[0], ws_left);
+        for (size_t i = 0; i < nb_imgs - 1; ++i) {
+            cpm_disp_fwd[i] = cpm_disp_step[i];
+            Mat1f disp_bwd = -cpm_disp_step[i+1];
+            disp_bwd.setTo(kMOVEMENT_UNKNOWN, cpm_disp_step[i+1] == kMOVEMENT_UNKNOWN);
+            cpm_disp_bwd[i] = disp_bwd;
+            // stats of the pair center -> i (or center -> i + 1 past the center)
+            cpm_stats[i] = cpm_view_stats[(int)i < center ? i : i + 1];
+        }
+    }
+    else {
+        // with -CPM_par the threads are used inside each pair instead
+        #pragma omp parallel for if(!cpm_pf_params.CPM_parallel)
+        for (size_t i = 0; i < nb_imgs - 1; ++i) {
+            int thread_id = 0;
+#ifdef _OPENMP
+            thread_id = omp_get_thread_num();
+#endif
+            CPMWorkspace& cpm_ws = cpm_workspaces[thread_id];
+
+            // Forward and backward (horizontal) disparity from a single run
+            Mat1f disp_fwd(height, width, kMOVEMENT_UNKNOWN);
+            Mat1f disp_bwd(height, width, kMOVEMENT_UNKNOWN);
+            cpm.MatchingToDisp(cpm_features[i], cpm_features[i+1], disp_fwd, disp_bwd, cpm_ws);
+            cpm_disp_fwd[i] = disp_fwd;
+            cpm_disp_bwd[i] = disp_bwd;
+            cpm_stats[i] = cpm_ws.Stats();
+        }
     }
     CPM_time.toc(" done in: ");
+    if (!cpm_pf_params.CPM_stats_file.empty())
+        CPMStats::SaveJSON(cpm_pf_params.CPM_stats_file.c_str(), &cpm_stats[0], cpm_stats.size());
 
 
     // Write CPM results on disk
@@ -421,28 +497,13 @@ int main(int argc, char** argv)
             disp_confidence = getHorDispConfidence(disp_forward, disp_backward);
         }
         
-        // Apply spatial permeability filter on confidence
+        // Apply spatial permeability filter on confidence and confidenced sparse disparity together,
+        // then normalize the filtered disparity by the filtered confidence
         PF.computeSpatialPermeabilityMaps();
-        Mat1f disp_confidence_filtered = PF.filterXY(disp_confidence);
-
-        // multiply initial confidence and sparse flow
-        Mat1f confidenced_disp;
-        if(i == (nb_imgs-1)) // For the last image, associate the backward flow with a minus sign
-        {
-            confidenced_disp = disp_backward.mul(-disp_confidence);    
-        }
+        if(i == (nb_imgs-1)) // For the last image, associate the backward disp with a minus sign
+            pf_spatial_disp_vec[i] = PF.filterXYNormalized(-disp_backward, disp_confidence);
         else
-        {
-            confidenced_disp = disp_forward.mul(disp_confidence);    
-        }
-            
-        // filter confidenced sparse flow
-        Mat1f confidenced_disp_XY = PF.filterXY(confidenced_disp);
-
-        // compute normalized spatial filtered flow FXY by division
-        Mat1f normalized_confidenced_disp_filtered = confidenced_disp_XY.mul(1 / disp_confidence_filtered);
-        
-        pf_spatial_disp_vec[i] = normalized_confidenced_disp_filtered;
+            pf_spatial_disp_vec[i] = PF.filterXYNormalized(disp_forward, disp_confidence);
     }
 
     sPF_time.toc(" done in: ");
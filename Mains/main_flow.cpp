@@ -20,6 +20,10 @@ extern "C" {
 #include "utils.h"
 #include "cpmpf_parameters.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 
 void Usage()
@@ -51,6 +55,15 @@ void Usage()
         << "    -CPM_cth                                   matching cost check threshold" <<endl
         << "    -CPM_stereo                                stereo flag" <<endl
         << "    -CPM_nstep                                 number of step giving the final result resolution" <<endl
+        << "    -CPM_desc_dim                              number of PCA components of the compact descriptor, 0 keeps the full DAISY" <<endl
+        << "    -CPM_pca                                   PCA basis file, loaded if it exists, otherwise trained on the first frame and saved" <<endl
+        << "    -CPM_par                                   parallel propagation inside each pair, useful when there are fewer pairs than cores" <<endl
+        << "    -CPM_tile_mb                               memory (MB) for the features of a pair, the fine levels of large frames are then matched in tiles; 0 (default) is unbounded" <<endl
+        << "    -CPM_bin_pyd                               1: fast pyramid (cascaded 5-tap binomial blur-and-decimate), 0 (default): each level blurred with its own sigma" <<endl
+        << "    -CPM_roi                                   x y w h: only match this region (and the part of the frames it can move to), the flow elsewhere is left unknown" <<endl
+        << "    -CPM_stats                                 JSON file receiving the per-level timings and counters (iterations, update ratios, check rejections) of every pair" <<endl
+        << "    -CPM_warm                                  initialize each pair from the flow of the previous one: 0 no (default), 1 yes, 2 yes and warped along the flow" <<endl
+        << "    -CPM_warm_radius                           search radius around the previous flow, default is 16" <<endl
         << "  PF:" << endl
         << "    Spatial parameters:" << endl
         << "    -PF_iter_XY                                number of iterations" << endl
@@ -98,6 +111,26 @@ void parse_cmd(int argc, char** argv, int current_arg, cpmpf_parameters &cpm_pf_
             cpm_pf_params.CPM_stereo_flag = atoi(argv[current_arg++]);
         else if( isarg("-CPM_nstep") )
             cpm_pf_params.CPM_step = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_desc_dim") )
+            cpm_pf_params.CPM_desc_dim = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_pca") )
+            cpm_pf_params.CPM_pca_file = string(argv[current_arg++]);
+        else if( isarg("-CPM_par") )
+            cpm_pf_params.CPM_parallel = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_tile_mb") )
+            cpm_pf_params.CPM_tile_mb = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_bin_pyd") )
+            cpm_pf_params.CPM_binomial_pyramid = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_roi") ) {
+            for (int k = 0; k < 4; k++)
+                cpm_pf_params.CPM_roi[k] = atoi(argv[current_arg++]);
+        }
+        else if( isarg("-CPM_stats") )
+            cpm_pf_params.CPM_stats_file = string(argv[current_arg++]);
+        else if( isarg("-CPM_warm") )
+            cpm_pf_params.CPM_warm_start = atoi(argv[current_arg++]);
+        else if( isarg("-CPM_warm_radius") )
+            cpm_pf_params.CPM_warm_radius = atoi(argv[current_arg++]);
         
         // Permeability Filter 
         // spatial parameters
@@ -280,34 +313,74 @@ int main(int argc, char** argv)
     
     CPM cpm;
     cpm_pf_params.to_CPM_params(cpm);
+    if (cpm_pf_params.CPM_desc_dim > 0 && !cpm.HasPCA()) {
+        FImage img(width, height, nch);
+        Mat3f2FImage(input_RGB_images_vec[0], img);
+        cpm.TrainPCA(img);
+        if (!cpm_pf_params.CPM_pca_file.empty())
+            cpm.SavePCA(cpm_pf_params.CPM_pca_file.c_str());
+    }
 
     vector<Mat2f> cpm_flow_fwd(nb_imgs-1), cpm_flow_bwd(nb_imgs-1);
-    
-    #pragma omp parallel for 
-    for (size_t i = 0; i < nb_imgs - 1; ++i) {
-        FImage img1(width, height, nch);
-        FImage img2(width, height, nch);
-        
-        Mat3f2FImage(input_RGB_images_vec[i],   img1);
-        Mat3f2FImage(input_RGB_images_vec[i+1], img2);
-
-        // Forward flow
-        FImage matches;
-        cpm.Matching(img1, img2, matches);
-
-        Mat2f flow_fwd(height, width, kMOVEMENT_UNKNOWN);
-        Match2Flow(matches, flow_fwd);
-        cpm_flow_fwd[i] = flow_fwd;
-
-        // Backward flow
-        matches.clear();
-        cpm.Matching(img2, img1, matches);
+    vector<CPMStats> cpm_stats(nb_imgs-1);
+
+    if (cpm_pf_params.CPM_parallel || cpm_pf_params.CPM_warm_start) {
+        // the pairs one after the other (-CPM_par uses the threads inside each pair,
+        // -CPM_warm needs the previous pair): the frames are streamed, only the
+        // features of the previous one are kept
+        CPMStream cpm_stream(cpm);
+        cpm_stream.SetWarmStart(cpm_pf_params.CPM_warm_start);
+        for (size_t i = 0; i < nb_imgs; ++i) {
+            FImage img(width, height, nch);
+            Mat3f2FImage(input_RGB_images_vec[i], img);
+
+            // Forward and backward flow from a single run
+            Mat2f flow_fwd(height, width, kMOVEMENT_UNKNOWN);
+            Mat2f flow_bwd(height, width, kMOVEMENT_UNKNOWN);
+            if (cpm_stream.Push(img, flow_fwd, flow_bwd)) {
+                cpm_flow_fwd[i-1] = flow_fwd;
+                cpm_flow_bwd[i-1] = flow_bwd;
+                cpm_stats[i-1] = cpm_stream.workspace().Stats();
+            }
+        }
+    }
+    else {
+        // one matching workspace per thread, reused for all the pairs it processes
+        int nb_threads = 1;
+#ifdef _OPENMP
+        nb_threads = omp_get_max_threads();
+#endif
+        vector<CPMWorkspace> cpm_workspaces(nb_threads);
+
+        // pyramid and features of each frame, built once and shared by the pairs it belongs to
+        vector<CPMFeatures> cpm_features(nb_imgs);
+        #pragma omp parallel for 
+        for (size_t i = 0; i < nb_imgs; ++i) {
+            FImage img(width, height, nch);
+            Mat3f2FImage(input_RGB_images_vec[i], img);
+            cpm.ExtractFeatures(img, cpm_features[i]);
+        }
 
-        Mat2f flow_bwd(height, width, kMOVEMENT_UNKNOWN);
-        Match2Flow(matches, flow_bwd);
-        cpm_flow_bwd[i] = flow_bwd;
+        #pragma omp parallel for 
+        for (size_t i = 0; i < nb_imgs - 1; ++i) {
+            int thread_id = 0;
+#ifdef _OPENMP
+            thread_id = omp_get_thread_num();
+#endif
+            CPMWorkspace& cpm_ws = cpm_workspaces[thread_id];
+
+            // Forward and backward flow from a single run
+            Mat2f flow_fwd(height, width, kMOVEMENT_UNKNOWN);
+            Mat2f flow_bwd(height, width, kMOVEMENT_UNKNOWN);
+            cpm.MatchingToFlow(cpm_features[i], cpm_features[i+1], flow_fwd, flow_bwd, cpm_ws);
+            cpm_flow_fwd[i] = flow_fwd;
+            cpm_flow_bwd[i] = flow_bwd;
+            cpm_stats[i] = cpm_ws.Stats();
+        }
     }
     CPM_time.toc(" done in: ");
+    if (!cpm_pf_params.CPM_stats_file.empty())
+        CPMStats::SaveJSON(cpm_pf_params.CPM_stats_file.c_str(), &cpm_stats[0], cpm_stats.size());
 
 
     // Write CPM results on disk
@@ -377,47 +450,13 @@ int main(int argc, char** argv)
             flow_confidence = getFlowConfidence(flow_forward, flow_backward);
         }
 
-        // Apply spatial permeability filter on confidence
+        // Apply spatial permeability filter on confidence and confidenced sparse flow together,
+        // then normalize the filtered flow by the filtered confidence
         PF.computeSpatialPermeabilityMaps();
-        Mat1f flow_confidence_filtered = PF.filterXY(flow_confidence);
-
-        // multiply initial confidence and sparse flow
-        Mat2f confidenced_flow = Mat2f::zeros(flow_confidence.rows,flow_confidence.cols);
         if(i == (nb_imgs-1)) // For the last image, associate the backward flow with a minus sign
-        {
-            for(int y = 0; y < confidenced_flow.rows; y++) {
-                for(int x = 0; x < confidenced_flow.cols; x++) {
-                    for(int c = 0; c < confidenced_flow.channels(); c++) {
-                        confidenced_flow(y,x)[c] = -flow_backward(y,x)[c] * flow_confidence(y,x);
-                    }
-                }
-            }
-        }
+            pf_spatial_flow_vec[i] = PF.filterXYNormalized<Vec2f>(-flow_backward, flow_confidence);
         else
-        {
-            for(int y = 0; y < confidenced_flow.rows; y++) {
-                for(int x = 0; x < confidenced_flow.cols; x++) {
-                    for(int c = 0; c < confidenced_flow.channels(); c++) {
-                        confidenced_flow(y,x)[c] = flow_forward(y,x)[c] * flow_confidence(y,x);
-                    }
-                }
-            }
-        }
-
-        //filter confidenced sparse flow
-        Mat2f confidenced_flow_XY = PF.filterXY<Vec2f>(confidenced_flow);
-
-        // compute normalized spatial filtered flow FXY by division
-        Mat2f normalized_confidenced_flow_filtered = Mat2f::zeros(confidenced_flow_XY.rows,confidenced_flow_XY.cols);
-        for(int y = 0; y < confidenced_flow_XY.rows; y++) {
-            for(int x = 0; x < confidenced_flow_XY.cols; x++) {
-                for(int c = 0; c < confidenced_flow_XY.channels(); c++) {
-                    normalized_confidenced_flow_filtered(y,x)[c] = confidenced_flow_XY(y,x)[c] / flow_confidence_filtered(y,x);
-                }
-            }
-        }
-
-        pf_spatial_flow_vec[i] = normalized_confidenced_flow_filtered;
+            pf_spatial_flow_vec[i] = PF.filterXYNormalized<Vec2f>(flow_forward, flow_confidence);
     }
 
     sPF_time.toc(" done in: ");
@@ -68,7 +68,7 @@ void Mat3f2FImage(Mat3f in, FImage &out) {
     }
 }
 
-void Match2Flow(FImage matches, Mat2f &flow)
+void Match2Flow(FImage& matches, Mat2f &flow)
 {
 	int h = flow.rows;
     int w = flow.cols;
@@ -92,7 +92,7 @@ void Match2Flow(FImage matches, Mat2f &flow)
 	}
 }
 
-void Match2Disp(FImage matches, Mat1f &disp, string parallax)
+void Match2Disp(FImage& matches, Mat1f &disp, string parallax)
 {
 	if(parallax != "ver" && parallax != "vertical" && parallax != "hor" && parallax != "horizontal") 
 	{
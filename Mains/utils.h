@@ -25,9 +25,9 @@ static inline int img_boundary_check(const float x, const int& MaxValue) {return
 /* ---------------- CONVERSION BETWEEN IMAGE TYPES --------------------------- */
 void Match2Flow(FImage& inMat, FImage& ou, FImage& ov, int w, int h);
 
-void Match2Flow(FImage matches, Mat2f &flow);
+void Match2Flow(FImage& matches, Mat2f &flow);
 
-void Match2Disp(FImage matches, Mat1f &disp, string parallax);
+void Match2Disp(FImage& matches, Mat1f &disp, string parallax);
 
 void WriteMatches(const char *filename, FImage& inMat);
 
@@ -18,6 +18,7 @@
 #include <opencv2/opencv.hpp>
 #include <cmath>
 #include <assert.h>
+#include "PermeabilityLanes.h"
 
 using namespace cv;
 using namespace std;
@@ -25,6 +26,10 @@ using namespace std;
 const float sqrt_2 = sqrt(2);
 const float sqrt_3 = sqrt(3);
 
+// Columns filtered together by the vertical pass of filterXY, so that each row
+// visited by the down and up passes is read as a block instead of one value at a time
+#define PF_BLOCK_COLS 16
+
 template <class TI>
 class PermeabilityFilter
 {
@@ -48,6 +53,21 @@ private:
     bool is_disp_set;
     bool is_I_T_set;
     bool is_perm_t_set;
+
+    // Edge-stopping function of Equation (2) for the squared color difference d2
+    static float edgeStopping(float d2, float scale, float alpha);
+    // Spatial filtering of J in place, with nch values per pixel
+    template <class T>
+    void filterXYInPlace(T* J, size_t step, int h, int w, int nch);
+    // Weighted filtering and normalization of J, with nch values per pixel, to out
+    template <class T>
+    void filterXYWeighted(const T* J, size_t step, const Mat1f& confidence, int h, int w, int nch, T* out, size_t out_step);
+    // Horizontal pass of filterXY on the row y of J
+    template <class T>
+    void filterRowXY(T* J, int y, int w, int nch, T* buf);
+    // Vertical pass of filterXY on the columns [x0, x1) of J
+    template <class T>
+    void filterColumnsXY(T* J, size_t step, int h, int nch, int x0, int x1, T* buf);
         
 public:
     PermeabilityFilter(); // Initializes default parameters
@@ -68,6 +88,9 @@ public:
     Mat1f filterXY(const Mat1f J); // For single-channel target image J
     template <class TJ>
     Mat_<TJ> filterXY(const Mat_<TJ> J); // For multi-channel target image J
+    Mat1f filterXYNormalized(const Mat1f J, const Mat1f confidence); // filterXY(J * confidence) / filterXY(confidence)
+    template <class TJ>
+    Mat_<TJ> filterXYNormalized(const Mat_<TJ> J, const Mat1f confidence);
 
 
     // Temporal parameters
@@ -313,13 +336,64 @@ void PermeabilityFilter<TI>::computeSpatialPermeabilityMaps()
         // return;
     }
 
-    computeSpatialPermeability("hor");
-    computeSpatialPermeability("ver");
+    // Equation (2) in paper "Towards Edge-Aware Spatio-Temporal Filtering in Real-Time", for both directions in one pass:
+    // the difference with the pixel on the right gives perm_h, with the pixel below perm_v. Outside the image the neighbour
+    // is 0, like the shifted copy of computeSpatialPermeability, which gives the same maps without transposes or temporaries.
+    typedef typename DataType<TI>::channel_type T;
+    int h = I_XY.rows;
+    int w = I_XY.cols;
+    int num_channels = I_XY.channels();
+    const float scale = 1 / (sqrt(3) * sigma_XY);
+
+    perm_h = Mat1f(h, w);
+    perm_v = Mat1f(h, w);
+
+    #pragma omp parallel for
+    for (int y = 0; y < h; y++) {
+        const T* I = I_XY.template ptr<T>(y);
+        const T* I_below = (y + 1 < h) ? I_XY.template ptr<T>(y + 1) : NULL;
+        float* p_h = perm_h[y];
+        float* p_v = perm_v[y];
+        for (int x = 0; x < w; x++) {
+            float dJdx = 0, dJdy = 0;
+            for (int c = 0; c < num_channels; c++) {
+                float diff_h = I[x * num_channels + c] - (x + 1 < w ? I[(x + 1) * num_channels + c] : 0);
+                float diff_v = I[x * num_channels + c] - (I_below ? I_below[x * num_channels + c] : 0);
+                dJdx = dJdx + diff_h * diff_h;
+                dJdy = dJdy + diff_v * diff_v;
+            }
+            p_h[x] = edgeStopping(dJdx, scale, alpha_XY);
+            p_v[x] = edgeStopping(dJdy, scale, alpha_XY);
+        }
+    }
 
     is_perm_xy_set = true;
 }
 
 
+// 1 / (1 + (sqrt(d2) * scale) ^ alpha), with the float operations of the Mat expressions in computeSpatialPermeability.
+// Integer powers are multiplied out like OpenCV's pow does, other powers go through std::pow.
+template <class TI>
+float PermeabilityFilter<TI>::edgeStopping(float d2, float scale, float alpha)
+{
+    float r = std::sqrt(d2) * scale;
+    int ipower = cvRound(alpha);
+    float r_alpha;
+    if (ipower >= 1 && ipower == alpha) {
+        r_alpha = 1;
+        float b = r;
+        for (int p = ipower; p > 1; p >>= 1) {
+            if (p & 1) r_alpha *= b;
+            b *= b;
+        }
+        r_alpha *= b;
+    }
+    else
+        r_alpha = std::pow(r, alpha);
+    return 1.f / (1.f + r_alpha);
+}
+
+
 // For single-channel target image J
 template <class TI>
 Mat1f PermeabilityFilter<TI>::filterXY(const Mat1f J)
@@ -330,75 +404,10 @@ Mat1f PermeabilityFilter<TI>::filterXY(const Mat1f J)
         exit (EXIT_FAILURE);
     }
 
-    // Input image
-    int h = J.rows;
-    int w = J.cols;
-
     // spatial filtering
     Mat1f J_XY;
     J.copyTo(J_XY);
-    
-    for (int i = 0; i < iter_XY; ++i) {
-        // spatial filtering
-        // Equation (5) and (6) in paper "Towards Edge-Aware Spatio-Temporal Filtering in Real-Time"
-
-        // horizontal
-        Mat1f J_XY_upper_h = Mat1f::zeros(h,w); //upper means upper of fractional number
-        Mat1f J_XY_lower_h = Mat1f::zeros(h,w);
-        for (int y = 0; y < h; y++) {
-            Mat1f lp = Mat1f::zeros(1,w);
-            Mat1f lp_normal = Mat1f::zeros(1,w);
-            Mat1f rp = Mat1f::zeros(1,w);
-            Mat1f rp_normal = Mat1f::zeros(1,w);
-
-            // left pass
-            for (int x = 1; x <= w-1; x++) {
-                    lp(0, x) = perm_h(y, x - 1) * (lp(0, x - 1) + J_XY(y, x - 1));
-                    lp_normal(0, x) = perm_h(y, x - 1) * (lp_normal(0, x - 1) + 1.0);
-            }
-        
-            // right pass & combining
-            for (int x = w-2; x >= 0; x--) {
-                rp(0, x) = perm_h(y, x) * (rp(0, x + 1) + J_XY(y, x + 1));
-                rp_normal(0, x) = perm_h(y, x) * (rp_normal(0, x + 1) + 1.0);
-                
-                //combination in right pass loop on-the-fly & deleted source image I
-                if (x == w-2) {
-                    J_XY(y, x+1) = (lp(0, x+1) + (1 - lambda_XY) * J_XY(y, x+1) + rp(0, x+1)) / (lp_normal(0, x+1) + 1.0 + rp_normal(0, x+1));
-                }
-
-                J_XY(y, x) = (lp(0, x) + (1 - lambda_XY) * J_XY(y, x) + rp(0, x)) / (lp_normal(0, x) + 1.0 + rp_normal(0, x));
-            }
-        }
-            
-
-        //vertical
-        Mat1f J_XY_upper_v = Mat1f::zeros(h,w);
-        Mat1f J_XY_lower_v = Mat1f::zeros(h,w);
-        for (int x = 0; x < w; x++) {
-            Mat1f dp = Mat1f::zeros(h,1);
-            Mat1f dp_normal = Mat1f::zeros(h,1);
-            Mat1f up = Mat1f::zeros(h,1);
-            Mat1f up_normal = Mat1f::zeros(h,1);
-
-            // (left pass) down pass
-            for (int y = 1; y <= h-1; y++) {
-                    dp(y, 0) = perm_v(y - 1, x) * (dp(y - 1, 0) + J_XY(y - 1, x));
-                    dp_normal(y, 0) = perm_v(y - 1, x) * (dp_normal(y - 1, 0) + 1.0);
-                }
-    
-            // (right pass) up pass & combining
-            for (int y = h-2; y >= 0; y--) {
-                up(y, 0) = perm_v(y, x) * (up(y + 1, 0) + J_XY(y + 1, x));
-                up_normal(y, 0) = perm_v(y, x) * (up_normal(y + 1, 0) + 1.0);
-
-                if(y == h-2) {
-                    J_XY(y+1, x) = (dp(y+1, 0) + (1 - lambda_XY) * J_XY(y+1, x) + up(y+1, 0)) / (dp_normal(y+1, 0) + 1.0 + up_normal(y+1, 0));
-                }
-                J_XY(y, x) = (dp(y, 0) + (1 - lambda_XY) * J_XY(y, x) + up(y, 0)) / (dp_normal(y, 0) + 1.0 + up_normal(y, 0));
-            }
-        }
-    }
+    filterXYInPlace<float>(J_XY.ptr<float>(0), J_XY.step1(), J.rows, J.cols, 1);
     return J_XY;
 }
 
@@ -415,81 +424,228 @@ Mat_<TJ> PermeabilityFilter<TI>::filterXY(const Mat_<TJ> J)
         // return Mat1f::zeros(J.rows, J.cols);
     }
 
-    // Input image
-    int h = J.rows;
-    int w = J.cols;
-
     // spatial filtering
-    int num_chs = J.channels();
+    typedef typename DataType<TJ>::channel_type T;
     Mat_<TJ> J_XY;
     J.copyTo(J_XY);
-    
-    
-    for (int i = 0; i < iter_XY; ++i) {
-        // spatial filtering
-        // Equation (5) and (6) in paper "Towards Edge-Aware Spatio-Temporal Filtering in Real-Time"
+    filterXYInPlace<T>(J_XY.template ptr<T>(0), J_XY.step1(), J.rows, J.cols, J.channels());
+    return J_XY;
+}
+
+
+// Confidence-weighted filtering of a single-channel J, normalized by the filtered confidence
+template <class TI>
+Mat1f PermeabilityFilter<TI>::filterXYNormalized(const Mat1f J, const Mat1f confidence)
+{
+    if(! is_perm_xy_set)
+    {
+        cerr << "Can not compute spatial permeability filtering, spatial permeability maps are not computed." << endl;
+        exit (EXIT_FAILURE);
+    }
+
+    Mat1f J_XY(J.rows, J.cols);
+    filterXYWeighted<float>(J.ptr<float>(0), J.step1(), confidence, J.rows, J.cols, 1, J_XY.ptr<float>(0), J_XY.step1());
+    return J_XY;
+}
+
+
+// Confidence-weighted filtering of a multi-channel J, normalized by the filtered confidence
+template <class TI>
+template <class TJ>
+Mat_<TJ> PermeabilityFilter<TI>::filterXYNormalized(const Mat_<TJ> J, const Mat1f confidence)
+{
+    if(! is_perm_xy_set)
+    {
+        cerr << "Can not compute spatial permeability filtering, spatial permeability maps are not computed." << endl;
+        exit (EXIT_FAILURE);
+    }
+
+    typedef typename DataType<TJ>::channel_type T;
+    Mat_<TJ> J_XY(J.rows, J.cols);
+    filterXYWeighted<T>(J.template ptr<T>(0), J.step1(), confidence, J.rows, J.cols, J.channels(), J_XY.template ptr<T>(0), J_XY.step1());
+    return J_XY;
+}
 
-        // horizontal
-        Mat_<TJ> J_XY_upper_h = Mat_<TJ>::zeros(h,w); //upper means upper of fractional number
-        Mat_<TJ> J_XY_lower_h = Mat_<TJ>::zeros(h,w);
-        for (int y = 0; y < h; y++) {
-            Mat_<TJ> lp = Mat_<TJ>::zeros(1,w);
-            Mat_<TJ> lp_normal = Mat_<TJ>::zeros(1,w);
-            Mat_<TJ> rp = Mat_<TJ>::zeros(1,w);
-            Mat_<TJ> rp_normal = Mat_<TJ>::zeros(1,w);
-
-            for (int c = 0; c < num_chs; c++) {
-                // left pass
-                for (int x = 1; x <= w-1; x++) {
-                        lp(0, x)[c] = perm_h(y, x - 1) * (lp(0, x - 1)[c] + J_XY(y, x - 1)[c]);
-                        lp_normal(0, x)[c] = perm_h(y, x - 1) * (lp_normal(0, x - 1)[c] + 1.0);
-                }
-            
-                // right pass & combining
-                for (int x = w-2; x >= 0; x--) {
-                    rp(0, x)[c] = perm_h(y, x) * (rp(0, x + 1)[c] + J_XY(y, x + 1)[c]);
-                    rp_normal(0, x)[c] = perm_h(y, x) * (rp_normal(0, x + 1)[c] + 1.0);
-                    
-                    //combination in right pass loop on-the-fly & deleted source image I
-                    if (x == w-2) {
-                        J_XY(y, x+1)[c] = (lp(0, x+1)[c] + (1 - lambda_XY) * J_XY(y, x+1)[c] + rp(0, x+1)[c]) / (lp_normal(0, x+1)[c] + 1.0 + rp_normal(0, x+1)[c]);
-                    }
-
-                    J_XY(y, x)[c] = (lp(0, x)[c] + (1 - lambda_XY) * J_XY(y, x)[c] + rp(0, x)[c]) / (lp_normal(0, x)[c] + 1.0 + rp_normal(0, x)[c]);
-                }
-            }
-        }
 
-        //vertical
-        Mat_<TJ> J_XY_upper_v = Mat_<TJ>::zeros(h,w);
-        Mat_<TJ> J_XY_lower_v = Mat_<TJ>::zeros(h,w);
+// The nch channels of J * confidence and the confidence are packed as nch + 1 channels and filtered in the same passes,
+// so that the permeability maps are read once. Each channel gets the same values as filtering it alone.
+template <class TI>
+template <class T>
+void PermeabilityFilter<TI>::filterXYWeighted(const T* J, size_t step, const Mat1f& confidence, int h, int w, int nch, T* out, size_t out_step)
+{
+    assert(confidence.rows == h && confidence.cols == w);
+    int packed_chs = nch + 1;
+    size_t packed_step = (size_t)w * packed_chs;
+    std::vector<T> packed(h * packed_step);
+
+    #pragma omp parallel for
+    for (int y = 0; y < h; y++) {
+        const T* J_row = J + y * step;
+        const float* conf_row = confidence.ptr<float>(y);
+        T* packed_row = &packed[y * packed_step];
         for (int x = 0; x < w; x++) {
-            Mat_<TJ> dp = Mat_<TJ>::zeros(h,1);
-            Mat_<TJ> dp_normal = Mat_<TJ>::zeros(h,1);
-            Mat_<TJ> up = Mat_<TJ>::zeros(h,1);
-            Mat_<TJ> up_normal = Mat_<TJ>::zeros(h,1);
-
-            for (int c = 0; c < num_chs; c++) {
-                // (left pass) down pass
-                for (int y = 1; y <= h-1; y++) {
-                        dp(y, 0)[c] = perm_v(y - 1, x) * (dp(y - 1, 0)[c] + J_XY(y - 1, x)[c]);
-                        dp_normal(y, 0)[c] = perm_v(y - 1, x) * (dp_normal(y - 1, 0)[c] + 1.0);
-                    }
-        
-                // (right pass) up pass & combining
-                for (int y = h-2; y >= 0; y--) {
-                    up(y, 0)[c] = perm_v(y, x) * (up(y + 1, 0)[c] + J_XY(y + 1, x)[c]);
-                    up_normal(y, 0)[c] = perm_v(y, x) * (up_normal(y + 1, 0)[c] + 1.0);
-
-                    if(y == h-2) {
-                        J_XY(y+1, x)[c] = (dp(y+1, 0)[c] + (1 - lambda_XY) * J_XY(y+1, x)[c] + up(y+1, 0)[c]) / (dp_normal(y+1, 0)[c] + 1.0 + up_normal(y+1, 0)[c]);
-                    }
-                    J_XY(y, x)[c] = (dp(y, 0)[c] + (1 - lambda_XY) * J_XY(y, x)[c] + up(y, 0)[c]) / (dp_normal(y, 0)[c] + 1.0 + up_normal(y, 0)[c]);
-                }
+            for (int c = 0; c < nch; c++)
+                packed_row[x * packed_chs + c] = J_row[x * nch + c] * conf_row[x];
+            packed_row[x * packed_chs + nch] = conf_row[x];
+        }
+    }
+
+    filterXYInPlace<T>(packed.data(), packed_step, h, w, packed_chs);
+
+    #pragma omp parallel for
+    for (int y = 0; y < h; y++) {
+        const T* packed_row = &packed[y * packed_step];
+        T* out_row = out + y * out_step;
+        for (int x = 0; x < w; x++)
+            for (int c = 0; c < nch; c++)
+                out_row[x * nch + c] = packed_row[x * packed_chs + c] / packed_row[x * packed_chs + nch];
+    }
+}
+
+
+// iter_XY horizontal and vertical passes on the h x w image J, with nch values per pixel and rows step values apart.
+// Rows, and then blocks of columns, are split across the threads, each with its own scratch buffers.
+// Float data goes PF_LANES rows or columns at a time when the CPU has AVX2, the remaining lines one by one.
+template <class TI>
+template <class T>
+void PermeabilityFilter<TI>::filterXYInPlace(T* J, size_t step, int h, int w, int nch)
+{
+    const float lambda = 1 - lambda_XY;
+
+    #pragma omp parallel
+    {
+        std::vector<T> buf((nch + 1) * std::max(w + 1, (h + 1) * PF_BLOCK_COLS));
+        std::vector<float> lanes_buf(pf_lanes_supported() ? pf_lanes_buffer_size(std::max(w, h), nch) : 0);
+
+        for (int i = 0; i < iter_XY; ++i) {
+            // spatial filtering
+            // Equation (5) and (6) in paper "Towards Edge-Aware Spatio-Temporal Filtering in Real-Time"
+
+            // horizontal
+            #pragma omp for schedule(static)
+            for (int y = 0; y < h; y += PF_LANES) {
+                int y1 = std::min(y + PF_LANES, h);
+                if (y1 - y == PF_LANES && pf_filter_rows(J + y * step, step, perm_h[y], perm_h.step1(), w, nch, lambda, lanes_buf.data()))
+                    continue;
+                for (int r = y; r < y1; r++)
+                    filterRowXY<T>(J + r * step, r, w, nch, &buf[0]);
+            }
+
+            //vertical
+            #pragma omp for schedule(static)
+            for (int x = 0; x < w; x += PF_BLOCK_COLS) {
+                int x0 = x, x1 = std::min(x + PF_BLOCK_COLS, w);
+                while (x1 - x0 >= PF_LANES && pf_filter_columns(J + x0 * nch, step, perm_v[0] + x0, perm_v.step1(), h, nch, lambda, lanes_buf.data()))
+                    x0 += PF_LANES;
+                if (x0 < x1)
+                    filterColumnsXY<T>(J, step, h, nch, x0, x1, &buf[0]);
             }
         }
     }
-    return J_XY;
+}
+
+
+// Horizontal pass of filterXY, Equation (5) and (6) along the row y, J points to its w * nch values.
+// buf holds (nch + 1) * (w + 1) values for lp, lp_normal, rp and rp_normal.
+template <class TI>
+template <class T>
+void PermeabilityFilter<TI>::filterRowXY(T* J, int y, int w, int nch, T* buf)
+{
+    const float* p = perm_h[y];
+    T* lp = buf;                    // w * nch values
+    T* lp_normal = lp + w * nch;    // w values, the same for every channel
+    T* rp = lp_normal + w;
+    T rp_normal = 0;
+    const T zero = 0;
+
+    // left pass
+    for (int c = 0; c < nch; c++) lp[c] = 0;
+    lp_normal[0] = 0;
+    for (int x = 1; x <= w-1; x++) {
+        for (int c = 0; c < nch; c++)
+            lp[x * nch + c] = p[x - 1] * (lp[(x - 1) * nch + c] + J[(x - 1) * nch + c]);
+        lp_normal[x] = p[x - 1] * (lp_normal[x - 1] + 1.0);
+    }
+
+    // right pass & combining
+    for (int c = 0; c < nch; c++) rp[c] = 0;
+    for (int x = w-2; x >= 0; x--) {
+        for (int c = 0; c < nch; c++)
+            rp[c] = p[x] * (rp[c] + J[(x + 1) * nch + c]);
+        rp_normal = p[x] * (rp_normal + 1.0);
+
+        //combination in right pass loop on-the-fly & deleted source image I
+        if (x == w-2) {
+            // rp and rp_normal are 0 on the last pixel
+            for (int c = 0; c < nch; c++)
+                J[(x + 1) * nch + c] = (lp[(x + 1) * nch + c] + (1 - lambda_XY) * J[(x + 1) * nch + c] + zero) / (lp_normal[x + 1] + 1.0 + zero);
+        }
+
+        for (int c = 0; c < nch; c++)
+            J[x * nch + c] = (lp[x * nch + c] + (1 - lambda_XY) * J[x * nch + c] + rp[c]) / (lp_normal[x] + 1.0 + rp_normal);
+    }
+}
+
+
+// Vertical pass of filterXY, Equation (5) and (6) along the columns [x0, x1), at most PF_BLOCK_COLS wide.
+// The columns of the block go down and up the rows together, which gives the same values as filtering
+// them one by one. buf holds (nch + 1) * (h + 1) * PF_BLOCK_COLS values for dp, dp_normal, up and up_normal.
+template <class TI>
+template <class T>
+void PermeabilityFilter<TI>::filterColumnsXY(T* J, size_t step, int h, int nch, int x0, int x1, T* buf)
+{
+    int bw = x1 - x0;
+    int n = bw * nch;
+    T* dp = buf;                    // h rows of n values
+    T* dp_normal = dp + h * n;      // h rows of bw values, the same for every channel
+    T* up = dp_normal + h * bw;
+    T* up_normal = up + n;
+    const T zero = 0;
+
+    // (left pass) down pass
+    for (int k = 0; k < n; k++) dp[k] = 0;
+    for (int b = 0; b < bw; b++) dp_normal[b] = 0;
+    for (int y = 1; y <= h-1; y++) {
+        const float* p = perm_v[y - 1] + x0;
+        const T* J_prev = J + (y - 1) * step + x0 * nch;
+        const T* dp_prev = dp + (y - 1) * n;
+        const T* dp_normal_prev = dp_normal + (y - 1) * bw;
+        T* dp_cur = dp + y * n;
+        T* dp_normal_cur = dp_normal + y * bw;
+        for (int b = 0; b < bw; b++) {
+            for (int c = 0; c < nch; c++)
+                dp_cur[b * nch + c] = p[b] * (dp_prev[b * nch + c] + J_prev[b * nch + c]);
+            dp_normal_cur[b] = p[b] * (dp_normal_prev[b] + 1.0);
+        }
+    }
+
+    // (right pass) up pass & combining
+    for (int k = 0; k < n; k++) up[k] = 0;
+    for (int b = 0; b < bw; b++) up_normal[b] = 0;
+    for (int y = h-2; y >= 0; y--) {
+        const float* p = perm_v[y] + x0;
+        T* J_cur = J + y * step + x0 * nch;
+        T* J_next = J_cur + step;
+        for (int b = 0; b < bw; b++) {
+            for (int c = 0; c < nch; c++)
+                up[b * nch + c] = p[b] * (up[b * nch + c] + J_next[b * nch + c]);
+            up_normal[b] = p[b] * (up_normal[b] + 1.0);
+        }
+
+        if(y == h-2) {
+            // up and up_normal are 0 on the last row
+            const T* dp_next = dp + (y + 1) * n;
+            const T* dp_normal_next = dp_normal + (y + 1) * bw;
+            for (int b = 0; b < bw; b++)
+                for (int c = 0; c < nch; c++)
+                    J_next[b * nch + c] = (dp_next[b * nch + c] + (1 - lambda_XY) * J_next[b * nch + c] + zero) / (dp_normal_next[b] + 1.0 + zero);
+        }
+        const T* dp_cur = dp + y * n;
+        const T* dp_normal_cur = dp_normal + y * bw;
+        for (int b = 0; b < bw; b++)
+            for (int c = 0; c < nch; c++)
+                J_cur[b * nch + c] = (dp_cur[b * nch + c] + (1 - lambda_XY) * J_cur[b * nch + c] + up[b * nch + c]) / (dp_normal_cur[b] + 1.0 + up_normal[b]);
+    }
 }
 
 
@@ -0,0 +1,235 @@
+#pragma once
+#ifndef PF_LANES_H
+#define PF_LANES_H
+
+/*
+Recursive passes of the spatial permeability filter, Equation (5) and (6), on PF_LANES
+independent lines at once. The recursion is serial along a line, so the lines are put
+side by side instead: after a transpose, position x of the 8 lines is one AVX register,
+and the data, the left/right accumulators and the normalization run in the same lanes.
+
+The arithmetic is the one of PermeabilityFilter::filterRowXY for float data: float
+accumulators, the normalization and the final division in double, then rounded to
+float. The results are therefore bit-identical to the scalar code.
+*/
+
+#include <stddef.h>
+#if defined(WITH_SSE) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PF_WITH_AVX
+#include <immintrin.h>
+#endif
+
+// lines filtered together
+#define PF_LANES 8
+
+// floats of scratch needed to filter PF_LANES lines of n pixels with nch channels
+static inline size_t pf_lanes_buffer_size(int n, int nch)
+{
+    return (size_t)PF_LANES * (2 * (size_t)n * (nch + 1) + nch);
+}
+
+#ifdef PF_WITH_AVX
+static inline bool pf_lanes_supported()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+// in place transpose of 8 rows of 8 floats
+__attribute__((target("avx2")))
+static inline void pf_transpose8_avx2(__m256* r)
+{
+    __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]), t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]), t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]), t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]), t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)), s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)), s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0)), s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0)), s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+    r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+    r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+    r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+    r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+    r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+    r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+    r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+// n floats of 8 rows, step floats apart, to n vectors of 8 lanes
+__attribute__((target("avx2")))
+static void pf_load_lanes_avx2(const float* src, size_t step, int n, float* dst)
+{
+    __m256 r[8];
+    int k = 0;
+    for (; k + 8 <= n; k += 8) {
+        for (int i = 0; i < 8; i++) r[i] = _mm256_loadu_ps(src + i * step + k);
+        pf_transpose8_avx2(r);
+        for (int i = 0; i < 8; i++) _mm256_storeu_ps(dst + (k + i) * 8, r[i]);
+    }
+    for (; k < n; k++)
+        for (int i = 0; i < 8; i++) dst[k * 8 + i] = src[i * step + k];
+}
+
+// back from n vectors of 8 lanes to 8 rows
+__attribute__((target("avx2")))
+static void pf_store_lanes_avx2(const float* src, int n, float* dst, size_t step)
+{
+    __m256 r[8];
+    int k = 0;
+    for (; k + 8 <= n; k += 8) {
+        for (int i = 0; i < 8; i++) r[i] = _mm256_loadu_ps(src + (k + i) * 8);
+        pf_transpose8_avx2(r);
+        for (int i = 0; i < 8; i++) _mm256_storeu_ps(dst + i * step + k, r[i]);
+    }
+    for (; k < n; k++)
+        for (int i = 0; i < 8; i++) dst[i * step + k] = src[k * 8 + i];
+}
+
+// p * (prev + 1.0) in double, rounded to float
+__attribute__((target("avx2")))
+static inline __m256 pf_normal_avx2(__m256 p, __m256 prev)
+{
+    const __m256d one = _mm256_set1_pd(1.0);
+    __m256d lo = _mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(p)), _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(prev)), one));
+    __m256d hi = _mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(p, 1)), _mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(prev, 1)), one));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(lo)), _mm256_cvtpd_ps(hi), 1);
+}
+
+// d = (l + lambda1 * d + r) / (l_normal + 1.0 + r_normal) for the nch channels of one position, r NULL for 0
+__attribute__((target("avx2")))
+static inline void pf_combine_avx2(float* d, const float* l, const float* r, __m256 l_normal, __m256 r_normal, int nch, __m256 lambda1)
+{
+    const __m256d one = _mm256_set1_pd(1.0);
+    __m256d den_lo = _mm256_add_pd(_mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(l_normal)), one), _mm256_cvtps_pd(_mm256_castps256_ps128(r_normal)));
+    __m256d den_hi = _mm256_add_pd(_mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(l_normal, 1)), one), _mm256_cvtps_pd(_mm256_extractf128_ps(r_normal, 1)));
+    for (int c = 0; c < nch; c++) {
+        __m256 num = _mm256_add_ps(_mm256_loadu_ps(l + c * 8), _mm256_mul_ps(lambda1, _mm256_loadu_ps(d + c * 8)));
+        num = _mm256_add_ps(num, r ? _mm256_loadu_ps(r + c * 8) : _mm256_setzero_ps());
+        __m128 lo = _mm256_cvtpd_ps(_mm256_div_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(num)), den_lo));
+        __m128 hi = _mm256_cvtpd_ps(_mm256_div_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(num, 1)), den_hi));
+        _mm256_storeu_ps(d + c * 8, _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1));
+    }
+}
+
+// Left and right passes on 8 lines of n positions. Position x holds nch vectors of 8 lanes at
+// data + x * dstride, its permeabilities are at perm + x * pstride. buf holds 8 * (n * (nch + 1) + nch) floats.
+__attribute__((target("avx2")))
+static void pf_filter_lanes_avx2(float* data, size_t dstride, const float* perm, size_t pstride, int n, int nch, float lambda, float* buf)
+{
+    if (n < 2) return;
+    float* lp = buf;                        // n * nch vectors
+    float* lp_normal = lp + n * nch * 8;    // n vectors
+    float* rp = lp_normal + n * 8;          // nch vectors
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 lambda1 = _mm256_set1_ps(lambda);
+
+    // left pass
+    for (int c = 0; c < nch; c++) _mm256_storeu_ps(lp + c * 8, zero);
+    _mm256_storeu_ps(lp_normal, zero);
+    __m256 ln = zero;
+    for (int x = 1; x <= n-1; x++) {
+        __m256 p = _mm256_loadu_ps(perm + (x - 1) * pstride);
+        const float* d = data + (x - 1) * dstride;
+        const float* l_prev = lp + (x - 1) * nch * 8;
+        float* l = lp + x * nch * 8;
+        for (int c = 0; c < nch; c++)
+            _mm256_storeu_ps(l + c * 8, _mm256_mul_ps(p, _mm256_add_ps(_mm256_loadu_ps(l_prev + c * 8), _mm256_loadu_ps(d + c * 8))));
+        ln = pf_normal_avx2(p, ln);
+        _mm256_storeu_ps(lp_normal + x * 8, ln);
+    }
+
+    // right pass & combining
+    for (int c = 0; c < nch; c++) _mm256_storeu_ps(rp + c * 8, zero);
+    __m256 rn = zero;
+    for (int x = n-2; x >= 0; x--) {
+        __m256 p = _mm256_loadu_ps(perm + x * pstride);
+        float* d = data + x * dstride;
+        float* d_next = d + dstride;
+        for (int c = 0; c < nch; c++)
+            _mm256_storeu_ps(rp + c * 8, _mm256_mul_ps(p, _mm256_add_ps(_mm256_loadu_ps(rp + c * 8), _mm256_loadu_ps(d_next + c * 8))));
+        rn = pf_normal_avx2(p, rn);
+
+        if (x == n-2)
+            pf_combine_avx2(d_next, lp + (x + 1) * nch * 8, NULL, _mm256_loadu_ps(lp_normal + (x + 1) * 8), zero, nch, lambda1);
+        pf_combine_avx2(d, lp + x * nch * 8, rp, _mm256_loadu_ps(lp_normal + x * 8), rn, nch, lambda1);
+    }
+}
+
+// horizontal pass on the 8 rows of w pixels starting at J
+__attribute__((target("avx2")))
+static void pf_filter_rows_avx2(float* J, size_t step, const float* perm, size_t pstep, int w, int nch, float lambda, float* buf)
+{
+    float* data = buf;
+    float* p = data + w * nch * 8;
+    pf_load_lanes_avx2(J, step, w * nch, data);
+    pf_load_lanes_avx2(perm, pstep, w, p);
+    pf_filter_lanes_avx2(data, nch * 8, p, 8, w, nch, lambda, p + w * 8);
+    pf_store_lanes_avx2(data, w * nch, J, step);
+}
+
+// vertical pass on the 8 columns of h pixels starting at J, the channels are deinterleaved first
+__attribute__((target("avx2")))
+static void pf_filter_columns_avx2(float* J, size_t step, const float* perm, size_t pstep, int h, int nch, float lambda, float* buf)
+{
+    if (nch == 1) {
+        pf_filter_lanes_avx2(J, step, perm, pstep, h, 1, lambda, buf);
+        return;
+    }
+    float* data = buf;
+    for (int y = 0; y < h; y++)
+        for (int b = 0; b < 8; b++)
+            for (int c = 0; c < nch; c++)
+                data[(y * nch + c) * 8 + b] = J[y * step + b * nch + c];
+    pf_filter_lanes_avx2(data, nch * 8, perm, pstep, h, nch, lambda, data + h * nch * 8);
+    for (int y = 0; y < h; y++)
+        for (int b = 0; b < 8; b++)
+            for (int c = 0; c < nch; c++)
+                J[y * step + b * nch + c] = data[(y * nch + c) * 8 + b];
+}
+#else
+static inline bool pf_lanes_supported()
+{
+    return false;
+}
+#endif
+
+// Horizontal pass on PF_LANES rows of float data, returns false when it has to be done line by line
+static inline bool pf_filter_rows(float* J, size_t step, const float* perm, size_t pstep, int w, int nch, float lambda, float* buf)
+{
+#ifdef PF_WITH_AVX
+    if (pf_lanes_supported()) {
+        pf_filter_rows_avx2(J, step, perm, pstep, w, nch, lambda, buf);
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Vertical pass on PF_LANES columns of float data, returns false when it has to be done line by line
+static inline bool pf_filter_columns(float* J, size_t step, const float* perm, size_t pstep, int h, int nch, float lambda, float* buf)
+{
+#ifdef PF_WITH_AVX
+    if (pf_lanes_supported()) {
+        pf_filter_columns_avx2(J, step, perm, pstep, h, nch, lambda, buf);
+        return true;
+    }
+#endif
+    return false;
+}
+
+// other data types always go line by line
+template <class T>
+static inline bool pf_filter_rows(T*, size_t, const float*, size_t, int, int, float, float*)
+{
+    return false;
+}
+
+template <class T>
+static inline bool pf_filter_columns(T*, size_t, const float*, size_t, int, int, float, float*)
+{
+    return false;
+}
+
+#endif //! PF_LANES_H
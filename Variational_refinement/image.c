@@ -5,6 +5,7 @@
 #include <math.h>
 
 #include "image.h"
+#include "CPM/include/PyrDown.h"
 
 #include <xmmintrin.h>
 typedef __v4sf v4sf;
@@ -490,6 +491,24 @@ void color_image_convolve_hv(color_image_t *dst, const color_image_t *src, const
     }
 }
 
+/************ Pyramid **********/
+
+/* return a new image of half the size, blurred with the 5-tap binomial filter and decimated (same as the CPM pyramid) */
+image_t *image_pyrdown(const image_t *src){
+    image_t *dst = image_new(src->width/2, src->height/2);
+    pyrdown_binomial(src->data, src->width, src->height, 1, src->stride, dst->data, dst->stride);
+    return dst;
+}
+
+/* return a new color image of half the size, blurred with the 5-tap binomial filter and decimated */
+color_image_t *color_image_pyrdown(const color_image_t *src){
+    color_image_t *dst = color_image_new(src->width/2, src->height/2);
+    pyrdown_binomial(src->c1, src->width, src->height, 1, src->stride, dst->c1, dst->stride);
+    pyrdown_binomial(src->c2, src->width, src->height, 1, src->stride, dst->c2, dst->stride);
+    pyrdown_binomial(src->c3, src->width, src->height, 1, src->stride, dst->c3, dst->stride);
+    return dst;
+}
+
 /************ Others **********/
 
 float pow2( float f ) {return f*f;}
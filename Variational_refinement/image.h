@@ -89,6 +89,14 @@ void convolution_delete(convolution_t *conv);
 /* perform horizontal and/or vertical convolution to a color image */
 void color_image_convolve_hv(color_image_t *dst, const color_image_t *src, const convolution_t *horiz_conv, const convolution_t *vert_conv);
 
+/************ Pyramid **********/
+
+/* return a new image of half the size, blurred with the 5-tap binomial filter and decimated (same as the CPM pyramid) */
+image_t *image_pyrdown(const image_t *src);
+
+/* return a new color image of half the size, blurred with the 5-tap binomial filter and decimated */
+color_image_t *color_image_pyrdown(const color_image_t *src);
+
 /************ Others **********/
 
 /* return a new image in lab color space */